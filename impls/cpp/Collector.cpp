@@ -0,0 +1,433 @@
+#include "Collector.h"
+#include "FreeQueue.h"
+#include "Types.h"
+
+#include <algorithm>
+#include <chrono>
+
+// Objects are black unless a collection is looking at them. Trial deletion
+// colours those it has subtracted the internal references of gray, and
+// then either black again, if something outside still refers to them, or
+// white. The white objects are garbage.
+enum {
+    BLACK,
+    GRAY,
+    WHITE,
+    GARBAGE,    // being freed
+};
+
+static int s_collections = 0;
+static long long s_traced = 0;
+static long long s_freed = 0;
+
+// Collection pauses, by the power of two of their length in microseconds.
+static const int PAUSE_BUCKETS = 24;
+static int s_pauses[PAUSE_BUCKETS];
+
+namespace {
+
+// Gathers the objects that something refers to.
+class malChildren : public malTracer {
+public:
+    const std::vector<const RefCounted*>& of(const RefCounted* object) {
+        m_children.clear();
+        object->traceRefs(*this);
+        return m_children;
+    }
+
+    virtual void visit(const RefCounted* object) {
+        m_children.push_back(object);
+    }
+
+private:
+    std::vector<const RefCounted*> m_children;
+};
+
+// Times a collection, for the histogram of pauses.
+class malPauseTimer {
+public:
+    malPauseTimer() : m_start(std::chrono::steady_clock::now()) { }
+
+    ~malPauseTimer() {
+        using namespace std::chrono;
+        long long us = duration_cast<microseconds>(
+            steady_clock::now() - m_start).count();
+        int bucket = 0;
+        while ((bucket < PAUSE_BUCKETS - 1) && (us >> bucket) > 0) {
+            bucket++;
+        }
+        s_pauses[bucket]++;
+        s_collections++;
+    }
+
+private:
+    std::chrono::steady_clock::time_point m_start;
+};
+
+}
+
+void malTracer::operator () (const malValuePtr& ref)
+{
+    if (ref.mayCycle()) {
+        visit(ref.ptr());
+    }
+}
+
+// The garbage has its counts as they really are. One more reference on each
+// object means nothing is freed while the cycles are broken, and then
+// dropping those frees them.
+void malCollector::freeGarbage(const ObjectVec& garbage)
+{
+    for (auto object : garbage) {
+        object->m_refCount++;
+    }
+    for (auto object : garbage) {
+        const_cast<RefCounted*>(object)->dropRefs();
+    }
+    for (auto object : garbage) {
+        object->release();
+    }
+    s_freed += garbage.size();
+}
+
+void malCollector::report(FILE* out)
+{
+    fprintf(out, "%d collections traced %lld objects, and freed %lld\n",
+            s_collections, s_traced, s_freed);
+    for (int i = 0; i < PAUSE_BUCKETS; i++) {
+        if (s_pauses[i] > 0) {
+            fprintf(out, "  pauses under %8lldus: %d\n", 1LL << i,
+                    s_pauses[i]);
+        }
+    }
+}
+
+#if MAL_GENERATIONAL_CYCLES
+
+static const int GENERATIONS = 3;
+
+// A generation is collected with the younger ones after every this many
+// collections of the one below it.
+static const int OLDER_RATIO = 10;
+
+// The lists of objects in each generation are plain data, so they're ready
+// before any static initialiser makes an object.
+static const RefCounted* s_generations[GENERATIONS];
+static int s_youngerCollections[GENERATIONS];
+
+size_t malCollector::s_youngCount = 0;
+
+void RefCounted::track() const
+{
+    m_generation = 0;
+    m_prev = NULL;
+    m_next = s_generations[0];
+    if (m_next) {
+        m_next->m_prev = this;
+    }
+    s_generations[0] = this;
+    malCollector::s_youngCount++;
+}
+
+void RefCounted::untrack() const
+{
+    if (m_prev) {
+        m_prev->m_next = m_next;
+    }
+    else {
+        s_generations[m_generation] = m_next;
+    }
+    if (m_next) {
+        m_next->m_prev = m_prev;
+    }
+}
+
+// Calls fn with each object in the generations up to oldest.
+template<class Fn>
+void malCollector::forEachObject(int oldest, Fn fn)
+{
+    for (int generation = 0; generation <= oldest; generation++) {
+        for (auto object = s_generations[generation]; object; ) {
+            auto next = object->m_next;
+            fn(object);
+            object = next;
+        }
+    }
+}
+
+int malCollector::collect()
+{
+    return collectGenerations(GENERATIONS - 1);
+}
+
+void malCollector::collectDue()
+{
+    int oldest = 0;
+    while ((oldest + 1 < GENERATIONS) &&
+           (s_youngerCollections[oldest + 1] >= OLDER_RATIO)) {
+        oldest++;
+    }
+    collectGenerations(oldest);
+}
+
+int malCollector::collectGenerations(int oldest)
+{
+    malPauseTimer timer;
+    malChildren children;
+    auto isCollected = [oldest](const RefCounted* object) {
+        return object->m_generation <= oldest;
+    };
+
+    // Objects waiting to be freed still hold their references, and are
+    // still in their generations.
+    malFreeQueue::drain(0);
+
+    // Subtract the references the objects hold on each other.
+    forEachObject(oldest, [&](const RefCounted* object) {
+        object->m_color = WHITE;
+        s_traced++;
+        for (auto child : children.of(object)) {
+            if (isCollected(child)) {
+                child->m_refCount--;
+            }
+        }
+    });
+
+    // Anything which still has references is reachable from outside, and
+    // so is everything it refers to.
+    ObjectVec pending;
+    forEachObject(oldest, [&](const RefCounted* object) {
+        if (object->m_refCount > 0) {
+            object->m_color = BLACK;
+            pending.push_back(object);
+        }
+    });
+    while (!pending.empty()) {
+        const RefCounted* object = pending.back();
+        pending.pop_back();
+        for (auto child : children.of(object)) {
+            if (isCollected(child) && (child->m_color == WHITE)) {
+                child->m_color = BLACK;
+                pending.push_back(child);
+            }
+        }
+    }
+
+    // Put the references back, and gather what wasn't reached.
+    ObjectVec garbage;
+    forEachObject(oldest, [&](const RefCounted* object) {
+        for (auto child : children.of(object)) {
+            if (isCollected(child)) {
+                child->m_refCount++;
+            }
+        }
+        if (object->m_color == WHITE) {
+            object->m_color = GARBAGE;
+            garbage.push_back(object);
+        }
+    });
+    freeGarbage(garbage);
+
+    // The survivors move up a generation.
+    int target = std::min(oldest + 1, GENERATIONS - 1);
+    for (int generation = 0; generation <= oldest; generation++) {
+        if (generation == target) {
+            continue;
+        }
+        while (const RefCounted* object = s_generations[generation]) {
+            object->untrack();
+            object->m_generation = target;
+            object->m_prev = NULL;
+            object->m_next = s_generations[target];
+            if (object->m_next) {
+                object->m_next->m_prev = object;
+            }
+            s_generations[target] = object;
+        }
+    }
+
+    s_youngCount = 0;
+    for (int generation = 0; generation <= oldest; generation++) {
+        s_youngerCollections[generation] = 0;
+    }
+    if (oldest + 1 < GENERATIONS) {
+        s_youngerCollections[oldest + 1]++;
+    }
+    return garbage.size();
+}
+
+#else
+
+// Collections start once this many candidates have built up. As each one
+// traces everything reachable from the candidates, the threshold rises with
+// the amount that was traced but still alive, so that a large live heap
+// isn't traced over and over for little return.
+static const size_t MIN_THRESHOLD = 10000;
+
+malCollector::ObjectVec malCollector::s_candidates;
+size_t malCollector::s_threshold = MIN_THRESHOLD;
+
+void RefCounted::addCandidate() const
+{
+    if (m_color != GARBAGE) {
+        m_isBuffered = true;
+        malCollector::s_candidates.push_back(this);
+    }
+}
+
+// Candidates are often freed in the reverse of the order they were added,
+// as frames are, so the latest can be taken back. Others are freed by the
+// next collection.
+void RefCounted::releaseCandidate() const
+{
+    auto& candidates = malCollector::s_candidates;
+    if (!candidates.empty() && candidates.back() == this) {
+        candidates.pop_back();
+        m_isBuffered = false;
+        destroy();
+    }
+}
+
+int malCollector::collect()
+{
+    malPauseTimer timer;
+
+    // Candidates whose counts have since dropped to zero were left for the
+    // collector to free. Freeing them can make more.
+    ObjectVec roots;
+    bool isFreeing;
+    do {
+        roots.insert(roots.end(), s_candidates.begin(), s_candidates.end());
+        s_candidates.clear();
+        isFreeing = false;
+        size_t live = 0;
+        for (size_t i = 0; i < roots.size(); i++) {
+            const RefCounted* object = roots[i];
+            if (object->m_refCount == 0) {
+                object->m_isBuffered = false;
+                object->destroy();
+                isFreeing = true;
+            }
+            else {
+                roots[live++] = object;
+            }
+        }
+        roots.resize(live);
+    } while (isFreeing || !s_candidates.empty());
+
+    long long traced = s_traced;
+    for (auto object : roots) {
+        markGray(object);
+    }
+    for (auto object : roots) {
+        scan(object);
+    }
+    for (auto object : roots) {
+        object->m_isBuffered = false;
+    }
+    ObjectVec garbage;
+    for (auto object : roots) {
+        collectWhite(object, garbage);
+    }
+    traced = s_traced - traced;
+
+    // Put back the references the garbage holds.
+    malChildren children;
+    for (auto object : garbage) {
+        for (auto child : children.of(object)) {
+            child->m_refCount++;
+        }
+    }
+    freeGarbage(garbage);
+
+    s_threshold = std::max(MIN_THRESHOLD,
+                           2 * size_t(traced - garbage.size()));
+    return garbage.size();
+}
+
+// Subtracts the references held by everything reachable from object.
+void malCollector::markGray(const RefCounted* object)
+{
+    if (object->m_color == GRAY) {
+        return;
+    }
+    object->m_color = GRAY;
+    s_traced++;
+
+    malChildren children;
+    ObjectVec pending(1, object);
+    while (!pending.empty()) {
+        object = pending.back();
+        pending.pop_back();
+        for (auto child : children.of(object)) {
+            child->m_refCount--;
+            if (child->m_color != GRAY) {
+                child->m_color = GRAY;
+                s_traced++;
+                pending.push_back(child);
+            }
+        }
+    }
+}
+
+// Whitens the gray objects with nothing else referring to them, and
+// blackens everything reachable from the rest.
+void malCollector::scan(const RefCounted* object)
+{
+    malChildren children;
+    ObjectVec pending(1, object);
+    while (!pending.empty()) {
+        object = pending.back();
+        pending.pop_back();
+        if (object->m_color != GRAY) {
+            continue;
+        }
+        if (object->m_refCount > 0) {
+            scanBlack(object);
+            continue;
+        }
+        object->m_color = WHITE;
+        const auto& objects = children.of(object);
+        pending.insert(pending.end(), objects.begin(), objects.end());
+    }
+}
+
+// Puts back the references held by everything reachable from object.
+void malCollector::scanBlack(const RefCounted* object)
+{
+    object->m_color = BLACK;
+
+    malChildren children;
+    ObjectVec pending(1, object);
+    while (!pending.empty()) {
+        object = pending.back();
+        pending.pop_back();
+        for (auto child : children.of(object)) {
+            child->m_refCount++;
+            if (child->m_color != BLACK) {
+                child->m_color = BLACK;
+                pending.push_back(child);
+            }
+        }
+    }
+}
+
+// Gathers the white objects reachable from object.
+void malCollector::collectWhite(const RefCounted* object, ObjectVec& garbage)
+{
+    malChildren children;
+    ObjectVec pending(1, object);
+    while (!pending.empty()) {
+        object = pending.back();
+        pending.pop_back();
+        if (object->m_color != WHITE) {
+            continue;
+        }
+        object->m_color = GARBAGE;
+        garbage.push_back(object);
+        const auto& objects = children.of(object);
+        pending.insert(pending.end(), objects.begin(), objects.end());
+    }
+}
+
+#endif
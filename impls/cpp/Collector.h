@@ -0,0 +1,111 @@
+#ifndef INCLUDE_COLLECTOR_H
+#define INCLUDE_COLLECTOR_H
+
+#include "RefCountedPtr.h"
+#include "ValuePtr.h"
+
+#include <stdio.h>
+#include <vector>
+
+// Reference counting never frees a cycle of objects, such as a lambda
+// defined in a let*, which holds the environment that holds it. The cycle
+// collector finds them by trial deletion (Bacon and Rajan, 2001):
+//
+// An object whose count drops to something other than zero becomes a
+// candidate, as every remaining reference to it might be from garbage. A
+// collection subtracts the references that the candidates, and everything
+// reachable from them, hold on each other. Whatever is left with a count
+// of zero is only referenced from within that garbage, and is freed, while
+// anything reachable from an object which still has a count is kept.
+//
+// Building with GENCYCLES=1 instead keeps every object that can be part of
+// a cycle in one of three generations. Objects start in the youngest, which
+// is collected the most often, and those that survive a collection move to
+// the next. A collection subtracts the references the objects in the
+// generations being collected hold on each other, and what's left is the
+// references from outside: older objects, the stacks and the globals. Those
+// are the roots, and anything they can't reach is garbage. This costs no
+// work as counts drop, but it does look at everything new. It's still a
+// cycle collector: objects are counted the same either way, and freed as
+// soon as their counts drop to zero.
+//
+// Only objects which can be part of a cycle take part: environments,
+// lambdas, atoms, and the sequences and maps that (transitively) hold them.
+// As a collection can't see references held by raw pointers, it only runs
+// at points where every live object is held by a counted reference.
+class malTracer {
+public:
+    virtual void visit(const RefCounted* object) = 0;
+
+    void operator () (const malValuePtr& ref);
+    void operator () (const malValuePtr* begin, const malValuePtr* end) {
+        for (auto it = begin; it != end; ++it) {
+            (*this)(*it);
+        }
+    }
+
+    template<class T>
+    void operator () (const RefCountedPtr<T>& ref) {
+        if (ref && ref->mayCycle()) {
+            visit(ref.ptr());
+        }
+    }
+
+    template<class T, class A>
+    void operator () (const std::vector<T, A>& refs) {
+        for (auto it = refs.begin(), end = refs.end(); it != end; ++it) {
+            (*this)(*it);
+        }
+    }
+};
+
+class malCollector {
+public:
+    // Frees any garbage cycles, and returns how many objects that was.
+    static int collect();
+
+    // Collects once enough candidates, or new objects, have built up. The
+    // evaluators call this between forms, and as they enter a function.
+    static void collectIfDue() {
+#if MAL_GENERATIONAL_CYCLES
+        if (s_youngCount >= YOUNG_THRESHOLD) {
+            collectDue();
+        }
+#else
+        if (s_candidates.size() >= s_threshold) {
+            collect();
+        }
+#endif
+    }
+
+    // Writes how many collections there have been, what they found, and
+    // how long they took.
+    static void report(FILE* out);
+
+private:
+    friend class RefCounted;
+
+    typedef std::vector<const RefCounted*> ObjectVec;
+
+    static void freeGarbage(const ObjectVec& garbage);
+
+#if MAL_GENERATIONAL_CYCLES
+    static const int YOUNG_THRESHOLD = 10000;
+
+    static void collectDue();
+    static int collectGenerations(int oldest);
+    template<class Fn> static void forEachObject(int oldest, Fn fn);
+
+    static size_t s_youngCount;
+#else
+    static void markGray(const RefCounted* object);
+    static void scan(const RefCounted* object);
+    static void scanBlack(const RefCounted* object);
+    static void collectWhite(const RefCounted* object, ObjectVec& garbage);
+
+    static ObjectVec s_candidates;
+    static size_t s_threshold;
+#endif
+};
+
+#endif // INCLUDE_COLLECTOR_H
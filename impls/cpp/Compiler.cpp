@@ -0,0 +1,818 @@
+#include "VM.h"
+#include "Environment.h"
+
+#include <algorithm>
+
+static const SymbolId s_ampersand   = internSymbol("&");
+static const SymbolId s_catchId     = internSymbol("catch*");
+
+namespace {
+
+struct LocalRefs {
+    vmLocalPtr          local;
+    std::vector<int>    offsets;    // of the instructions which use it
+};
+
+// The state of a function while it is being compiled.
+struct FunctionState {
+    FunctionState(FunctionState* enclosing)
+    : enclosing(enclosing), proto(new vmProto), nextSlot(0), depth(0) { }
+
+    FunctionState*          enclosing;
+    vmProtoPtr              proto;
+    vmLocalPtr              locals;     // innermost local in scope
+    vmLocalPtr              blockStart; // innermost local outside the block
+    std::vector<LocalRefs>  refs;
+    int                     nextSlot;
+    int                     depth;      // of the operand stack
+};
+
+class Compiler {
+public:
+    Compiler(malEnvPtr env) : m_env(env), m_fs(NULL) { }
+
+    vmProtoPtr compileFunction(const SymbolIdVec& params, malValuePtr body,
+                               int sharedCount = 0);
+
+private:
+    typedef void (Compiler::*SpecialForm)(const malList* list, bool tail);
+
+    void compile(malValuePtr ast, bool tail);
+    void compileList(malValuePtr ast, bool tail);
+    void compileSymbol(SymbolId id);
+    void compileCall(malValuePtr ast, bool tail);
+    void compileItems(const malSequence* seq, int first);
+    bool compileMacro(malValuePtr ast, bool tail);
+
+    void compileDef(const malList* list, bool tail);
+    void compileDefMacro(const malList* list, bool tail);
+    void compileDefinition(const malList* list, bool isMacro);
+    void compileDo(const malList* list, bool tail);
+    void compileFn(const malList* list, bool tail);
+    void compileIf(const malList* list, bool tail);
+    void compileLet(const malList* list, bool tail);
+    void compileMacroExpand(const malList* list, bool tail);
+    void compileQuasiQuoteExpand(const malList* list, bool tail);
+    void compileQuasiQuote(const malList* list, bool tail);
+    void compileQuote(const malList* list, bool tail);
+    void compileTry(const malList* list, bool tail);
+
+    static SpecialForm specialForm(SymbolId id);
+
+    vmLocalPtr findLocal(FunctionState* fs, SymbolId id, bool withPending);
+    int findUpvalue(FunctionState* fs, SymbolId id);
+    int captureLocal(FunctionState* fs, FunctionState* owner,
+                     const vmLocalPtr& local);
+    std::vector<vmShadowed> findShadowed(SymbolId id);
+    int addUpvalue(FunctionState* fs, SymbolId id, bool isLocal, int index);
+
+    vmLocalPtr declareLocal(SymbolId id);
+    void useLocal(const vmLocalPtr& local, int op);
+
+    int emit(int op, int delta);
+    int emit(int op, int operand, int delta);
+    int emit(int op, int operand1, int operand2, int delta);
+    int emitJump(int op, int delta);
+    void patchJump(int offset, int operandIndex = 0);
+    int addConstant(malValuePtr value);
+    int addCell(SymbolId id);
+    void emitConstant(malValuePtr value);
+
+    malEnvPtr      m_env;
+    FunctionState* m_fs;
+};
+
+// Saves enough of the compiler's state to abandon a partly compiled form.
+struct Checkpoint {
+    Checkpoint(FunctionState* fs)
+    : locals(fs->locals), blockStart(fs->blockStart)
+    , codeSize(fs->proto->code.size())
+    , callSiteCount(fs->proto->callSites.size())
+    , varNameCount(fs->proto->varNames.size())
+    , refCount(fs->refs.size())
+    , nextSlot(fs->nextSlot), depth(fs->depth) { }
+
+    void restore(FunctionState* fs) const {
+        fs->locals = locals;
+        fs->blockStart = blockStart;
+        fs->proto->code.resize(codeSize);
+        fs->proto->callSites.resize(callSiteCount);
+        fs->proto->varNames.resize(varNameCount);
+        fs->refs.resize(refCount);
+        for (auto it = fs->refs.begin(), end = fs->refs.end(); it != end; ++it) {
+            auto& offsets = it->offsets;
+            offsets.erase(std::lower_bound(offsets.begin(), offsets.end(),
+                                           (int)codeSize),
+                          offsets.end());
+        }
+        fs->nextSlot = nextSlot;
+        fs->depth = depth;
+    }
+
+    vmLocalPtr locals;
+    vmLocalPtr blockStart;
+    size_t codeSize, callSiteCount, varNameCount, refCount;
+    int nextSlot, depth;
+};
+
+// Starts a new block of locals, and ends it when it goes out of scope.
+class Block {
+public:
+    Block(FunctionState* fs)
+    : m_fs(fs), m_locals(fs->locals), m_blockStart(fs->blockStart)
+    , m_nextSlot(fs->nextSlot) {
+        fs->blockStart = fs->locals;
+    }
+
+    ~Block() {
+        m_fs->locals = m_locals;
+        m_fs->blockStart = m_blockStart;
+        m_fs->nextSlot = m_nextSlot;
+    }
+
+private:
+    FunctionState*   m_fs;
+    const vmLocalPtr m_locals;
+    const vmLocalPtr m_blockStart;
+    const int        m_nextSlot;
+};
+
+}
+
+vmProtoPtr Compiler::compileFunction(const SymbolIdVec& params,
+                                     malValuePtr body, int sharedCount)
+{
+    FunctionState fs(m_fs);
+    vmProto* proto = fs.proto.ptr();
+    proto->params = params;
+    proto->body = body;
+
+    int n = params.size();
+    for (int i = 0; i < n; i++) {
+        if (params[i] == s_ampersand) {
+            MAL_CHECK(i == n - 2, "There must be one parameter after the &");
+            proto->isVariadic = true;
+            continue;
+        }
+        vmLocalPtr local(new vmLocal(params[i], fs.nextSlot++, fs.locals));
+        local->isPending = false;
+        fs.locals = local;
+        fs.refs.push_back(LocalRefs());
+        fs.refs.back().local = local;
+    }
+    proto->arity = proto->isVariadic ? n - 2 : n;
+    proto->slotCount = fs.nextSlot;
+
+    m_fs = &fs;
+    try {
+        compile(body, true);
+        emit(OP_RETURN, -1);
+    }
+    catch (...) {
+        m_fs = fs.enclosing;
+        throw;
+    }
+    m_fs = fs.enclosing;
+
+    // Now that we know which locals are captured by closures, switch them
+    // over to living in boxes. The shared parameters of an expansion that it
+    // sets arrive in boxes already.
+    for (auto it = fs.refs.begin(), end = fs.refs.end(); it != end; ++it) {
+        int slot = it->local->slot;
+        bool isParam = slot < proto->arity + proto->isVariadic;
+        if (slot < sharedCount &&
+            std::any_of(it->offsets.begin(), it->offsets.end(),
+                        [proto](int offset) {
+                            return proto->code[offset] == OP_SET_LOCAL;
+                        })) {
+            it->local->isCaptured = true;
+            proto->sharedParams.push_back(slot);
+        }
+        else if (!it->local->isCaptured) {
+            continue;
+        }
+        else if (isParam) {
+            proto->boxedParams.push_back(slot);
+        }
+        for (int offset : it->offsets) {
+            uint8_t& op = proto->code[offset];
+            switch (op) {
+                case OP_GET_LOCAL:  op = OP_GET_BOXED;  break;
+                case OP_SET_LOCAL:  op = OP_SET_BOXED;  break;
+                case OP_DECLARE:    op = OP_BOX;        break;
+            }
+        }
+    }
+    return fs.proto;
+}
+
+void Compiler::compile(malValuePtr ast, bool tail)
+{
+    if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, ast)) {
+        compileSymbol(symbol->id());
+        return;
+    }
+    if (const malList* list = DYNAMIC_CAST(malList, ast)) {
+        if (!list->isEmpty()) {
+            compileList(ast, tail);
+            return;
+        }
+    }
+    else if (const malVector* vector = DYNAMIC_CAST(malVector, ast)) {
+        compileItems(vector, 0);
+        emit(OP_VECTOR, vector->count(), 1 - vector->count());
+        return;
+    }
+    else if (const malHash* hash = DYNAMIC_CAST(malHash, ast)) {
+        if (!hash->isEvaluated()) {
+            malValuePtr keyList = hash->keys();
+            const malSequence* keys = STATIC_CAST(malSequence, keyList);
+            for (auto it = keys->begin(), end = keys->end(); it != end; ++it) {
+                emitConstant(*it);
+                compile(hash->get(*it), false);
+            }
+            int count = 2 * keys->count();
+            emit(OP_HASH, count, 1 - count);
+            return;
+        }
+    }
+    emitConstant(ast);
+}
+
+void Compiler::compileList(malValuePtr ast, bool tail)
+{
+    // Errors found while compiling are only raised if the code is run,
+    // which is when an interpreter would have found them.
+    Checkpoint checkpoint(m_fs);
+    try {
+        const malList* list = STATIC_CAST(malList, ast);
+        if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, list->item(0))) {
+            if (SpecialForm handler = specialForm(symbol->id())) {
+                (this->*handler)(list, tail);
+                return;
+            }
+        }
+        if (!compileMacro(ast, tail)) {
+            compileCall(ast, tail);
+        }
+    }
+    catch (String& s) {
+        checkpoint.restore(m_fs);
+        emit(OP_THROW, addConstant(mal::string(s)), 1);
+    }
+    catch (malValuePtr& o) {
+        checkpoint.restore(m_fs);
+        emit(OP_THROW_VALUE, addConstant(o), 1);
+    }
+}
+
+// Expands the form now if its operator is a global macro which isn't
+// shadowed by a local.
+bool Compiler::compileMacro(malValuePtr ast, bool tail)
+{
+    const malList* list = STATIC_CAST(malList, ast);
+    const malSymbol* symbol = DYNAMIC_CAST(malSymbol, list->item(0));
+    if (!symbol) {
+        return false;
+    }
+
+    SymbolId id = symbol->id();
+    for (FunctionState* fs = m_fs; fs; fs = fs->enclosing) {
+        if (findLocal(fs, id, true)) {
+            return false;
+        }
+    }
+    malValuePtr value = m_env->cell(id)->value();
+    const malLambda* macro = DYNAMIC_CAST(malLambda, value);
+    if (!macro || !macro->isMacro()) {
+        return false;
+    }
+
+    compile(macro->apply(list->begin() + 1, list->end()), tail);
+    return true;
+}
+
+void Compiler::compileCall(malValuePtr ast, bool tail)
+{
+    const malList* list = STATIC_CAST(malList, ast);
+    vmProto* proto = m_fs->proto.ptr();
+
+    // If the operator is a variable, it might turn out to be a macro: a
+    // global by being defined as one later on, and a local or upvalue by
+    // having one passed in.
+    int opOffset = proto->code.size();
+    compile(list->item(0), false);
+    bool isVariable = DYNAMIC_CAST(malSymbol, list->item(0)) != NULL;
+    if (isVariable) {
+        if (proto->code[opOffset] == OP_GET_GLOBAL) {
+            proto->code[opOffset] = OP_GET_CALLEE;
+        }
+        else {
+            opOffset = emit(OP_CHECK_CALLEE, 0);
+        }
+    }
+    compileItems(list, 1);
+
+    int argCount = list->count() - 1;
+    emit(tail ? OP_TAIL_CALL : OP_CALL, argCount, -argCount);
+    if (!isVariable) {
+        return;
+    }
+
+    MAL_CHECK(proto->callSites.size() < 0x10000, "Too many calls to compile");
+    vmCallSite site;
+    site.offset = opOffset;
+    site.end = proto->code.size();
+    site.form = ast;
+    site.blockLocals = 0;
+    SymbolIdVec seen;
+    bool isInBlock = true;
+    for (vmLocal* local = m_fs->locals.ptr(); local;
+         local = local->outer.ptr()) {
+        isInBlock = isInBlock && local != m_fs->blockStart.ptr();
+        if (!local->isPending &&
+            std::find(seen.begin(), seen.end(), local->id) == seen.end()) {
+            seen.push_back(local->id);
+            site.locals.push_back(local);
+            site.blockLocals += isInBlock;
+        }
+    }
+
+    // Calls within the arguments were added first, so keep them in order.
+    std::vector<vmCallSite>& sites = proto->callSites;
+    auto it = sites.end();
+    while (it != sites.begin() && (it - 1)->offset > opOffset) {
+        --it;
+    }
+    sites.insert(it, site);
+}
+
+void Compiler::compileItems(const malSequence* seq, int first)
+{
+    for (int i = first; i < seq->count(); i++) {
+        compile(seq->item(i), false);
+    }
+}
+
+void Compiler::compileSymbol(SymbolId id)
+{
+    vmProto* proto = m_fs->proto.ptr();
+    if (vmLocalPtr local = findLocal(m_fs, id, false)) {
+        int offset = proto->code.size();
+        useLocal(local, OP_GET_LOCAL);
+        proto->varNames.push_back(vmVarName { offset, id, findShadowed(id) });
+        return;
+    }
+
+    int index = findUpvalue(m_fs, id);
+    if (index >= 0) {
+        int offset = emit(OP_GET_UPVALUE, index, 1);
+        proto->varNames.push_back(vmVarName { offset, id, findShadowed(id) });
+        return;
+    }
+
+    emit(OP_GET_GLOBAL, addCell(id), 1);
+}
+
+void Compiler::compileDef(const malList* list, bool tail)
+{
+    checkArgsIs("def!", 2, list->count() - 1);
+    compileDefinition(list, false);
+}
+
+void Compiler::compileDefMacro(const malList* list, bool tail)
+{
+    checkArgsIs("defmacro!", 2, list->count() - 1);
+    compileDefinition(list, true);
+}
+
+void Compiler::compileDefinition(const malList* list, bool isMacro)
+{
+    SymbolId id = VALUE_CAST(malSymbol, list->item(1))->id();
+
+    // Outside of any function or let*, this defines a global.
+    if (!m_fs->enclosing && !m_fs->locals) {
+        compile(list->item(2), false);
+        if (isMacro) {
+            emit(OP_MACRO, 0);
+        }
+        emit(OP_DEF_GLOBAL, addCell(id), 0);
+        return;
+    }
+
+    // Otherwise it defines (or redefines) a local in the innermost block.
+    vmLocalPtr local;
+    for (vmLocal* it = m_fs->locals.ptr(); it != m_fs->blockStart.ptr();
+         it = it->outer.ptr()) {
+        if (it->id == id) {
+            local = it;
+            break;
+        }
+    }
+    // The def! might not run, so a new local is given a slot that no code
+    // before it has used, which is still unset if it doesn't. A slot left
+    // over from an earlier block would hold that block's value.
+    bool isNew = !local;
+    if (isNew) {
+        m_fs->nextSlot = std::max(m_fs->nextSlot, m_fs->proto->slotCount);
+        local = declareLocal(id);
+    }
+    compile(list->item(2), false);
+    if (isMacro) {
+        emit(OP_MACRO, 0);
+    }
+    emit(OP_DUP, 1);
+    useLocal(local, OP_SET_LOCAL);
+    local->isPending = false;
+}
+
+void Compiler::compileDo(const malList* list, bool tail)
+{
+    int argCount = checkArgsAtLeast("do", 1, list->count() - 1);
+    for (int i = 1; i < argCount; i++) {
+        compile(list->item(i), false);
+        emit(OP_POP, -1);
+    }
+    compile(list->item(argCount), tail);
+}
+
+void Compiler::compileFn(const malList* list, bool tail)
+{
+    checkArgsIs("fn*", 2, list->count() - 1);
+
+    const malSequence* bindings = VALUE_CAST(malSequence, list->item(1));
+    SymbolIdVec params;
+    for (int i = 0; i < bindings->count(); i++) {
+        const malSymbol* sym = VALUE_CAST(malSymbol, bindings->item(i));
+        params.push_back(sym->id());
+    }
+
+    vmProtoPtr proto = compileFunction(params, list->item(2));
+    std::vector<vmProtoPtr>& protos = m_fs->proto->protos;
+    MAL_CHECK(protos.size() < 0x10000, "Too many functions to compile");
+    protos.push_back(proto);
+    emit(OP_CLOSURE, protos.size() - 1, 1);
+}
+
+void Compiler::compileIf(const malList* list, bool tail)
+{
+    int argCount = checkArgsBetween("if", 2, 3, list->count() - 1);
+
+    compile(list->item(1), false);
+    int elseJump = emitJump(OP_JUMP_IF_FALSE, -1);
+    compile(list->item(2), tail);
+    int endJump = emitJump(OP_JUMP, -1);
+    patchJump(elseJump);
+    if (argCount == 3) {
+        compile(list->item(3), tail);
+    }
+    else {
+        emit(OP_NIL, 1);
+    }
+    patchJump(endJump);
+}
+
+void Compiler::compileLet(const malList* list, bool tail)
+{
+    checkArgsIs("let*", 2, list->count() - 1);
+    const malSequence* bindings = VALUE_CAST(malSequence, list->item(1));
+    int count = checkArgsEven("let*", bindings->count());
+
+    // All of the bindings share a scope, so closures in one binding can
+    // refer to those which follow it.
+    Block block(m_fs);
+    std::vector<vmLocalPtr> locals;
+    for (int i = 0; i < count; i += 2) {
+        const malSymbol* var = VALUE_CAST(malSymbol, bindings->item(i));
+        locals.push_back(declareLocal(var->id()));
+    }
+    for (int i = 0; i < count; i += 2) {
+        const vmLocalPtr& local = locals[i / 2];
+        compile(bindings->item(i+1), false);
+        useLocal(local, OP_SET_LOCAL);
+        local->isPending = false;
+    }
+    compile(list->item(2), tail);
+}
+
+void Compiler::compileMacroExpand(const malList* list, bool tail)
+{
+    checkArgsIs("macroexpand", 1, list->count() - 1);
+    emit(OP_MACROEXPAND, addConstant(list->item(1)), 1);
+}
+
+void Compiler::compileQuasiQuoteExpand(const malList* list, bool tail)
+{
+    checkArgsIs("quasiquote", 1, list->count() - 1);
+    emitConstant(quasiquote(list->item(1)));
+}
+
+void Compiler::compileQuasiQuote(const malList* list, bool tail)
+{
+    checkArgsIs("quasiquote", 1, list->count() - 1);
+    compile(quasiquote(list->item(1)), tail);
+}
+
+void Compiler::compileQuote(const malList* list, bool tail)
+{
+    checkArgsIs("quote", 1, list->count() - 1);
+    emitConstant(list->item(1));
+}
+
+void Compiler::compileTry(const malList* list, bool tail)
+{
+    int argCount = list->count() - 1;
+    if (argCount == 1) {
+        compile(list->item(1), tail);
+        return;
+    }
+    checkArgsIs("try*", 2, argCount);
+    const malList* catchBlock = VALUE_CAST(malList, list->item(2));
+
+    checkArgsIs("catch*", 2, catchBlock->count() - 1);
+    MAL_CHECK(VALUE_CAST(malSymbol, catchBlock->item(0))->id() == s_catchId,
+        "catch block must begin with catch*");
+    const malSymbol* excSym = VALUE_CAST(malSymbol, catchBlock->item(1));
+
+    int tryOffset = emit(OP_TRY, 0, 0, 0);
+
+    // The body can't be in tail position, as the handler has to be removed
+    // once it's done.
+    compile(list->item(1), false);
+    int endJump = emitJump(OP_END_TRY, 0);
+
+    // The handler is entered with the exception on the stack.
+    patchJump(tryOffset, 0);
+    Block block(m_fs);
+    vmLocalPtr local = declareLocal(excSym->id());
+    useLocal(local, OP_SET_LOCAL);
+    local->isPending = false;
+    compile(catchBlock->item(2), tail);
+
+    patchJump(endJump);
+    patchJump(tryOffset, 1);
+}
+
+Compiler::SpecialForm Compiler::specialForm(SymbolId id)
+{
+    static std::vector<SpecialForm> s_specialForms;
+    if (s_specialForms.empty()) {
+        static const struct {
+            const char* symbol;
+            SpecialForm handler;
+        } specialFormTable[] = {
+            { "def!",               &Compiler::compileDef },
+            { "defmacro!",          &Compiler::compileDefMacro },
+            { "do",                 &Compiler::compileDo },
+            { "fn*",                &Compiler::compileFn },
+            { "if",                 &Compiler::compileIf },
+            { "let*",               &Compiler::compileLet },
+            { "macroexpand",        &Compiler::compileMacroExpand },
+            { "quasiquoteexpand",   &Compiler::compileQuasiQuoteExpand },
+            { "quasiquote",         &Compiler::compileQuasiQuote },
+            { "quote",              &Compiler::compileQuote },
+            { "try*",               &Compiler::compileTry },
+        };
+        for (auto &form : specialFormTable) {
+            SymbolId formId = internSymbol(form.symbol);
+            if (formId >= (int)s_specialForms.size()) {
+                s_specialForms.resize(formId + 1);
+            }
+            s_specialForms[formId] = form.handler;
+        }
+    }
+    return id < (int)s_specialForms.size() ? s_specialForms[id] : NULL;
+}
+
+// Pending locals are still being initialised, so references to them from
+// their own initial value see the binding outside instead. References from
+// a closure created there do see them though, to allow recursion.
+vmLocalPtr Compiler::findLocal(FunctionState* fs, SymbolId id,
+                               bool withPending)
+{
+    for (vmLocal* local = fs->locals.ptr(); local;
+         local = local->outer.ptr()) {
+        if ((local->id == id) && (withPending || !local->isPending)) {
+            return local;
+        }
+    }
+    return NULL;
+}
+
+int Compiler::findUpvalue(FunctionState* fs, SymbolId id)
+{
+    if (!fs->enclosing) {
+        return -1;
+    }
+    if (vmLocalPtr local = findLocal(fs->enclosing, id, true)) {
+        local->isCaptured = true;
+        return addUpvalue(fs, id, true, local->slot);
+    }
+    int index = findUpvalue(fs->enclosing, id);
+    if (index >= 0) {
+        return addUpvalue(fs, id, false, index);
+    }
+    return -1;
+}
+
+// Captures a local of owner, an enclosing function of fs, as an upvalue of
+// fs. Returns its index.
+int Compiler::captureLocal(FunctionState* fs, FunctionState* owner,
+                           const vmLocalPtr& local)
+{
+    if (fs->enclosing == owner) {
+        local->isCaptured = true;
+        return addUpvalue(fs, local->id, true, local->slot);
+    }
+    int index = captureLocal(fs->enclosing, owner, local);
+    return addUpvalue(fs, local->id, false, index);
+}
+
+// Finds the bindings shadowed by the one a reference to id resolves to,
+// which are those it would see if the innermost were removed. The ones in
+// enclosing functions are captured so they can be read.
+std::vector<vmShadowed> Compiler::findShadowed(SymbolId id)
+{
+    std::vector<vmShadowed> shadowed;
+    bool isInnermost = true;
+    for (FunctionState* fs = m_fs; fs; fs = fs->enclosing) {
+        for (vmLocal* local = fs->locals.ptr(); local;
+             local = local->outer.ptr()) {
+            if ((local->id != id) || (local->isPending && fs == m_fs)) {
+                continue;
+            }
+            if (isInnermost) {
+                isInnermost = false;
+            }
+            else if (fs == m_fs) {
+                shadowed.push_back(vmShadowed { local, -1 });
+            }
+            else {
+                shadowed.push_back(vmShadowed {
+                    NULL, captureLocal(m_fs, fs, local) });
+            }
+        }
+    }
+    return shadowed;
+}
+
+int Compiler::addUpvalue(FunctionState* fs, SymbolId id,
+                         bool isLocal, int index)
+{
+    std::vector<vmUpvalue>& upvalues = fs->proto->upvalues;
+    for (int i = 0; i < (int)upvalues.size(); i++) {
+        if (upvalues[i].isLocal == isLocal && upvalues[i].index == index) {
+            return i;
+        }
+    }
+    MAL_CHECK(upvalues.size() < 0x10000, "Too many variables to capture");
+    upvalues.push_back(vmUpvalue { id, isLocal, index });
+    return upvalues.size() - 1;
+}
+
+vmLocalPtr Compiler::declareLocal(SymbolId id)
+{
+    FunctionState* fs = m_fs;
+    MAL_CHECK(fs->nextSlot < 0x10000, "Too many locals to compile");
+    vmLocalPtr local(new vmLocal(id, fs->nextSlot++, fs->locals));
+    fs->locals = local;
+    fs->proto->slotCount = std::max(fs->proto->slotCount, fs->nextSlot);
+    fs->refs.push_back(LocalRefs());
+    fs->refs.back().local = local;
+    useLocal(local, OP_DECLARE);
+    return local;
+}
+
+void Compiler::useLocal(const vmLocalPtr& local, int op)
+{
+    FunctionState* fs = m_fs;
+    int delta = (op == OP_GET_LOCAL) ? 1 : (op == OP_SET_LOCAL) ? -1 : 0;
+    int offset = emit(op, local->slot, delta);
+    for (auto it = fs->refs.rbegin(), end = fs->refs.rend(); it != end; ++it) {
+        if (it->local == local) {
+            it->offsets.push_back(offset);
+            return;
+        }
+    }
+    ASSERT(false, "Local %s has no references\n", symbolName(local->id).c_str());
+}
+
+int Compiler::emit(int op, int delta)
+{
+    std::vector<uint8_t>& code = m_fs->proto->code;
+    int offset = code.size();
+    code.push_back(op);
+
+    m_fs->depth += delta;
+    vmProto* proto = m_fs->proto.ptr();
+    proto->stackSize = std::max(proto->stackSize,
+                                proto->slotCount + m_fs->depth);
+    return offset;
+}
+
+int Compiler::emit(int op, int operand, int delta)
+{
+    MAL_CHECK(operand >= 0 && operand < 0x10000, "Operand out of range");
+    int offset = emit(op, delta);
+    std::vector<uint8_t>& code = m_fs->proto->code;
+    code.push_back(operand & 0xff);
+    code.push_back(operand >> 8);
+    return offset;
+}
+
+int Compiler::emit(int op, int operand1, int operand2, int delta)
+{
+    int offset = emit(op, operand1, delta);
+    MAL_CHECK(operand2 >= 0 && operand2 < 0x10000, "Operand out of range");
+    std::vector<uint8_t>& code = m_fs->proto->code;
+    code.push_back(operand2 & 0xff);
+    code.push_back(operand2 >> 8);
+    return offset;
+}
+
+int Compiler::emitJump(int op, int delta)
+{
+    return emit(op, 0, delta);
+}
+
+// Points the operandIndex'th operand of the jump at offset to the next
+// instruction. Offsets are relative to the end of the jump instruction.
+void Compiler::patchJump(int offset, int operandIndex)
+{
+    std::vector<uint8_t>& code = m_fs->proto->code;
+    int operandCount = (code[offset] == OP_TRY) ? 2 : 1;
+    int jump = code.size() - (offset + 1 + 2 * operandCount);
+    MAL_CHECK(jump < 0x10000, "Function too large to compile");
+    code[offset + 1 + 2 * operandIndex]     = jump & 0xff;
+    code[offset + 1 + 2 * operandIndex + 1] = jump >> 8;
+}
+
+int Compiler::addConstant(malValuePtr value)
+{
+    malValueVec& constants = m_fs->proto->constants;
+    MAL_CHECK(constants.size() < 0x10000, "Too many constants to compile");
+    constants.push_back(value);
+    return constants.size() - 1;
+}
+
+int Compiler::addCell(SymbolId id)
+{
+    std::vector<malCellPtr>& cells = m_fs->proto->cells;
+    for (int i = 0; i < (int)cells.size(); i++) {
+        if (cells[i]->id() == id) {
+            return i;
+        }
+    }
+    MAL_CHECK(cells.size() < 0x10000, "Too many globals to compile");
+    cells.push_back(m_env->cell(id));
+    return cells.size() - 1;
+}
+
+void Compiler::emitConstant(malValuePtr value)
+{
+    if (value == mal::nilValue()) {
+        emit(OP_NIL, 1);
+    }
+    else if (value == mal::trueValue()) {
+        emit(OP_TRUE, 1);
+    }
+    else if (value == mal::falseValue()) {
+        emit(OP_FALSE, 1);
+    }
+    else {
+        emit(OP_CONST, addConstant(value), 1);
+    }
+}
+
+int vmProto::findCallSite(int offset) const
+{
+    auto it = std::lower_bound(callSites.begin(), callSites.end(), offset,
+        [](const vmCallSite& site, int offset) {
+            return site.offset < offset;
+        });
+    ASSERT(it != callSites.end() && it->offset == offset,
+           "No call site recorded at offset %d\n", offset);
+    return it - callSites.begin();
+}
+
+const vmVarName& vmProto::findVarName(int offset) const
+{
+    auto it = std::lower_bound(varNames.begin(), varNames.end(), offset,
+        [](const vmVarName& name, int offset) {
+            return name.offset < offset;
+        });
+    ASSERT(it != varNames.end() && it->offset == offset,
+           "No variable name recorded at offset %d\n", offset);
+    return *it;
+}
+
+vmProtoPtr vmCompile(malValuePtr ast, malEnvPtr env)
+{
+    return Compiler(env).compileFunction(SymbolIdVec(), ast);
+}
+
+vmProtoPtr vmCompileLifted(malValuePtr ast, const SymbolIdVec& params,
+                           int sharedCount, malEnvPtr env)
+{
+    return Compiler(env).compileFunction(params, ast, sharedCount);
+}
@@ -1,4 +1,5 @@
 #include "MAL.h"
+#include "Collector.h"
 #include "Environment.h"
 #include "StaticList.h"
 #include "Types.h"
@@ -25,22 +26,34 @@ static String printValues(malValueIter begin, malValueIter end,
 static StaticList<malBuiltIn*> handlers;
 
 #define ARG(type, name) type* name = VALUE_CAST(type, *argsBegin++)
+#define ARG_INT(name)   int64_t name = INTEGER_CAST(*argsBegin++)
+
+// A builtin's arguments are held for the call alone, so one which nothing
+// else refers to can be updated in place, or have its items taken, rather
+// than copied. Callers mustn't pass items of a sequence directly.
+static bool isUnique(const malValue* arg)
+{
+    return arg->refCount() == 1;
+}
 
 #define FUNCNAME(uniq) builtIn ## uniq
 #define HRECNAME(uniq) handler ## uniq
-#define BUILTIN_DEF(uniq, symbol) \
+#define BUILTIN_DEF(uniq, symbol, updatesInPlace) \
     static malBuiltIn::ApplyFunc FUNCNAME(uniq); \
     static StaticList<malBuiltIn*>::Node HRECNAME(uniq) \
-        (handlers, new malBuiltIn(symbol, FUNCNAME(uniq))); \
+        (handlers, new malBuiltIn(symbol, FUNCNAME(uniq), updatesInPlace)); \
     malValuePtr FUNCNAME(uniq)(const String& name, \
         malValueIter argsBegin, malValueIter argsEnd)
 
-#define BUILTIN(symbol)  BUILTIN_DEF(__LINE__, symbol)
+#define BUILTIN(symbol)  BUILTIN_DEF(__LINE__, symbol, false)
+
+// For those which update their first argument in place if it's unique.
+#define BUILTIN_UPDATING(symbol)  BUILTIN_DEF(__LINE__, symbol, true)
 
 #define BUILTIN_ISA(symbol, type) \
     BUILTIN(symbol) { \
         CHECK_ARGS_IS(1); \
-        return mal::boolean(DYNAMIC_CAST(type, *argsBegin)); \
+        return mal::boolean(IS_A(type, *argsBegin)); \
     }
 
 #define BUILTIN_IS(op, constant) \
@@ -52,12 +65,12 @@ static StaticList<malBuiltIn*> handlers;
 #define BUILTIN_INTOP(op, checkDivByZero) \
     BUILTIN(#op) { \
         CHECK_ARGS_IS(2); \
-        ARG(malInteger, lhs); \
-        ARG(malInteger, rhs); \
+        ARG_INT(lhs); \
+        ARG_INT(rhs); \
         if (checkDivByZero) { \
-            MAL_CHECK(rhs->value() != 0, "Division by zero"); \
+            MAL_CHECK(rhs != 0, "Division by zero"); \
         } \
-        return mal::integer(lhs->value() op rhs->value()); \
+        return mal::integer(lhs op rhs); \
     }
 
 BUILTIN_ISA("atom?",        malAtom);
@@ -82,64 +95,64 @@ BUILTIN_IS("nil?",          nilValue);
 BUILTIN("-")
 {
     int argCount = CHECK_ARGS_BETWEEN(1, 2);
-    ARG(malInteger, lhs);
+    ARG_INT(lhs);
     if (argCount == 1) {
-        return mal::integer(- lhs->value());
+        return mal::integer(- lhs);
     }
 
-    ARG(malInteger, rhs);
-    return mal::integer(lhs->value() - rhs->value());
+    ARG_INT(rhs);
+    return mal::integer(lhs - rhs);
 }
 
 BUILTIN("<=")
 {
     CHECK_ARGS_IS(2);
-    ARG(malInteger, lhs);
-    ARG(malInteger, rhs);
+    ARG_INT(lhs);
+    ARG_INT(rhs);
 
-    return mal::boolean(lhs->value() <= rhs->value());
+    return mal::boolean(lhs <= rhs);
 }
 
 BUILTIN(">=")
 {
     CHECK_ARGS_IS(2);
-    ARG(malInteger, lhs);
-    ARG(malInteger, rhs);
+    ARG_INT(lhs);
+    ARG_INT(rhs);
 
-    return mal::boolean(lhs->value() >= rhs->value());
+    return mal::boolean(lhs >= rhs);
 }
 
 BUILTIN("<")
 {
     CHECK_ARGS_IS(2);
-    ARG(malInteger, lhs);
-    ARG(malInteger, rhs);
+    ARG_INT(lhs);
+    ARG_INT(rhs);
 
-    return mal::boolean(lhs->value() < rhs->value());
+    return mal::boolean(lhs < rhs);
 }
 
 BUILTIN(">")
 {
     CHECK_ARGS_IS(2);
-    ARG(malInteger, lhs);
-    ARG(malInteger, rhs);
+    ARG_INT(lhs);
+    ARG_INT(rhs);
 
-    return mal::boolean(lhs->value() > rhs->value());
+    return mal::boolean(lhs > rhs);
 }
 
 BUILTIN("=")
 {
     CHECK_ARGS_IS(2);
-    const malValue* lhs = (*argsBegin++).ptr();
-    const malValue* rhs = (*argsBegin++).ptr();
+    const malValuePtr& lhs = *argsBegin++;
+    const malValuePtr& rhs = *argsBegin++;
 
-    return mal::boolean(lhs->isEqualTo(rhs));
+    return mal::boolean(lhs.isEqualTo(rhs));
 }
 
 BUILTIN("apply")
 {
     CHECK_ARGS_AT_LEAST(2);
-    malValuePtr op = *argsBegin++; // this gets checked in APPLY
+    const malValuePtr& op = *argsBegin++; // this gets checked in APPLY
 
     // Copy the first N-1 arguments in.
     malValueVec args(argsBegin, argsEnd-1);
@@ -150,15 +163,29 @@ BUILTIN("apply")
         args.push_back(lastArg->item(i));
     }
 
-    return APPLY(op, args.begin(), args.end());
+    return APPLY(op, args.data(), args.data() + args.size());
 }
 
-BUILTIN("assoc")
+BUILTIN_UPDATING("assoc")
 {
     CHECK_ARGS_AT_LEAST(1);
+    if (malVector* vector = DYNAMIC_CAST(malVector, *argsBegin)) {
+        ++argsBegin;
+        return isUnique(vector) ? vector->assocUnique(argsBegin, argsEnd)
+                                : vector->assoc(argsBegin, argsEnd);
+    }
     ARG(malHash, hash);
 
-    return hash->assoc(argsBegin, argsEnd);
+    return isUnique(hash) ? hash->assocUnique(argsBegin, argsEnd)
+                          : hash->assoc(argsBegin, argsEnd);
+}
+
+BUILTIN("assoc!")
+{
+    CHECK_ARGS_AT_LEAST(1);
+    ARG(malTransient, transient);
+
+    return transient->assoc(argsBegin, argsEnd);
 }
 
 BUILTIN("atom")
@@ -187,23 +214,37 @@ BUILTIN("concat")
     return mal::list(items);
 }
 
-BUILTIN("conj")
+BUILTIN_UPDATING("conj")
 {
     CHECK_ARGS_AT_LEAST(1);
     ARG(malSequence, seq);
 
-    return seq->conj(argsBegin, argsEnd);
+    return isUnique(seq) ? seq->conjUnique(argsBegin, argsEnd)
+                         : seq->conj(argsBegin, argsEnd);
+}
+
+BUILTIN("conj!")
+{
+    CHECK_ARGS_AT_LEAST(1);
+    ARG(malTransient, transient);
+
+    return transient->conj(argsBegin, argsEnd);
 }
 
 BUILTIN("cons")
 {
     CHECK_ARGS_IS(2);
-    malValuePtr first = *argsBegin++;
+    const malValuePtr& first = *argsBegin++;
     ARG(malSequence, rest);
 
     malValueVec* items = new malValueVec(1 + rest->count());
     items->at(0) = first;
-    std::copy(rest->begin(), rest->end(), items->begin() + 1);
+    if (isUnique(rest)) {
+        rest->moveItemsTo(items->data() + 1);
+    }
+    else {
+        std::copy(rest->begin(), rest->end(), items->begin() + 1);
+    }
 
     return mal::list(items);
 }
@@ -214,6 +255,9 @@ BUILTIN("contains?")
     if (*argsBegin == mal::nilValue()) {
         return *argsBegin;
     }
+    if (malTransient* transient = DYNAMIC_CAST(malTransient, *argsBegin)) {
+        return mal::boolean(transient->contains(argsBegin[1]));
+    }
     ARG(malHash, hash);
     return mal::boolean(hash->contains(*argsBegin));
 }
@@ -224,6 +268,9 @@ BUILTIN("count")
     if (*argsBegin == mal::nilValue()) {
         return mal::integer(0);
     }
+    if (malTransient* transient = DYNAMIC_CAST(malTransient, *argsBegin)) {
+        return mal::integer(transient->count());
+    }
 
     ARG(malSequence, seq);
     return mal::integer(seq->count());
@@ -237,12 +284,21 @@ BUILTIN("deref")
     return atom->deref();
 }
 
-BUILTIN("dissoc")
+BUILTIN_UPDATING("dissoc")
 {
     CHECK_ARGS_AT_LEAST(1);
     ARG(malHash, hash);
 
-    return hash->dissoc(argsBegin, argsEnd);
+    return isUnique(hash) ? hash->dissocUnique(argsBegin, argsEnd)
+                          : hash->dissoc(argsBegin, argsEnd);
+}
+
+BUILTIN("dissoc!")
+{
+    CHECK_ARGS_AT_LEAST(1);
+    ARG(malTransient, transient);
+
+    return transient->dissoc(argsBegin, argsEnd);
 }
 
 BUILTIN("empty?")
@@ -272,7 +328,7 @@ BUILTIN("first")
 BUILTIN("fn?")
 {
     CHECK_ARGS_IS(1);
-    malValuePtr arg = *argsBegin++;
+    const malValuePtr& arg = *argsBegin++;
 
     // Lambdas are functions, unless they're macros.
     if (const malLambda* lambda = DYNAMIC_CAST(malLambda, arg)) {
@@ -282,12 +338,22 @@ BUILTIN("fn?")
     return mal::boolean(DYNAMIC_CAST(malBuiltIn, arg));
 }
 
+// Runs the cycle collector now, returning the number of objects it freed.
+BUILTIN("gc")
+{
+    CHECK_ARGS_IS(0);
+    return mal::integer(malCollector::collect());
+}
+
 BUILTIN("get")
 {
     CHECK_ARGS_IS(2);
     if (*argsBegin == mal::nilValue()) {
         return *argsBegin;
     }
+    if (malTransient* transient = DYNAMIC_CAST(malTransient, *argsBegin)) {
+        return transient->get(argsBegin[1]);
+    }
     ARG(malHash, hash);
     return hash->get(*argsBegin);
 }
@@ -307,7 +373,7 @@ BUILTIN("keys")
 BUILTIN("keyword")
 {
     CHECK_ARGS_IS(1);
-    const malValuePtr arg = *argsBegin++;
+    const malValuePtr& arg = *argsBegin++;
     if (malKeyword* s = DYNAMIC_CAST(malKeyword, arg))
       return s;
     if (const malString* s = DYNAMIC_CAST(malString, arg))
@@ -332,14 +398,15 @@ BUILTIN("macro?")
 BUILTIN("map")
 {
     CHECK_ARGS_IS(2);
-    malValuePtr op = *argsBegin++; // this gets checked in APPLY
+    const malValuePtr& op = *argsBegin++; // this gets checked in APPLY
     ARG(malSequence, source);
 
     const int length = source->count();
     malValueVec* items = new malValueVec(length);
     auto it = source->begin();
     for (int i = 0; i < length; i++) {
-      items->at(i) = APPLY(op, it+i, it+i+1);
+      malValuePtr arg = it[i]; // the call has its own reference
+      items->at(i) = APPLY(op, &arg, &arg + 1);
     }
 
     return  mal::list(items);
@@ -348,7 +415,7 @@ BUILTIN("map")
 BUILTIN("meta")
 {
     CHECK_ARGS_IS(1);
-    malValuePtr obj = *argsBegin++;
+    const malValuePtr& obj = *argsBegin++;
 
     return obj->meta();
 }
@@ -356,15 +423,26 @@ BUILTIN("meta")
 BUILTIN("nth")
 {
     CHECK_ARGS_IS(2);
+    if (malTransient* transient = DYNAMIC_CAST(malTransient, *argsBegin)) {
+        return transient->nth(INTEGER_CAST(argsBegin[1]));
+    }
     ARG(malSequence, seq);
-    ARG(malInteger,  index);
+    ARG_INT(index);
 
-    int i = index->value();
+    int i = index;
     MAL_CHECK(i >= 0 && i < seq->count(), "Index out of range");
 
     return seq->item(i);
 }
 
+BUILTIN("persistent!")
+{
+    CHECK_ARGS_IS(1);
+    ARG(malTransient, transient);
+
+    return transient->persistent();
+}
+
 BUILTIN("pr-str")
 {
     return mal::string(printValues(argsBegin, argsEnd, " ", true));
@@ -418,13 +496,12 @@ BUILTIN("rest")
 BUILTIN("seq")
 {
     CHECK_ARGS_IS(1);
-    malValuePtr arg = *argsBegin++;
+    const malValuePtr& arg = *argsBegin++;
     if (arg == mal::nilValue()) {
         return mal::nilValue();
     }
     if (const malSequence* seq = DYNAMIC_CAST(malSequence, arg)) {
-        return seq->isEmpty() ? mal::nilValue()
-                              : mal::list(seq->begin(), seq->end());
+        return seq->isEmpty() ? mal::nilValue() : seq->slice(0);
     }
     if (const malString* strVal = DYNAMIC_CAST(malString, arg)) {
         const String str = strVal->value();
@@ -471,14 +548,32 @@ BUILTIN("swap!")
     CHECK_ARGS_AT_LEAST(2);
     ARG(malAtom, atom);
 
-    malValuePtr op = *argsBegin++; // this gets checked in APPLY
+    const malValuePtr& op = *argsBegin++; // this gets checked in APPLY
 
     malValueVec args(1 + argsEnd - argsBegin);
     args[0] = atom->deref();
     std::copy(argsBegin, argsEnd, args.begin() + 1);
 
-    malValuePtr value = APPLY(op, args.begin(), args.end());
-    return atom->reset(value);
+    // A builtin which updates its argument in place is given the atom's
+    // only reference to the value, leaving nil there meanwhile. Anything
+    // that might call back into mal code could deref the atom, so gets a
+    // copy.
+    const malBuiltIn* builtIn = DYNAMIC_CAST(malBuiltIn, op);
+    bool isTaking = builtIn && builtIn->updatesInPlace();
+    if (isTaking) {
+        atom->reset(mal::nilValue());
+    }
+    malValuePtr value;
+    try {
+        value = APPLY(op, args.data(), args.data() + args.size());
+    }
+    catch (...) {
+        if (isTaking) {
+            atom->reset(std::move(args[0]));
+        }
+        throw;
+    }
+    return atom->reset(std::move(value));
 }
 
 BUILTIN("symbol")
@@ -506,6 +601,17 @@ BUILTIN("time-ms")
     return mal::integer(ms.count());
 }
 
+BUILTIN("transient")
+{
+    CHECK_ARGS_IS(1);
+    if (const malVector* vector = DYNAMIC_CAST(malVector, *argsBegin)) {
+        return vector->transient();
+    }
+    ARG(malHash, hash);
+
+    return hash->transient();
+}
+
 BUILTIN("vals")
 {
     CHECK_ARGS_IS(1);
@@ -529,13 +635,14 @@ BUILTIN("with-meta")
 {
     CHECK_ARGS_IS(2);
     malValuePtr obj  = *argsBegin++;
-    malValuePtr meta = *argsBegin++;
+    const malValuePtr& meta = *argsBegin++;
     return obj->withMeta(meta);
 }
 
 void installCore(malEnvPtr env) {
     for (auto it = handlers.begin(), end = handlers.end(); it != end; ++it) {
         malBuiltIn* handler = *it;
+        handler->makeImmortal();
         env->set(handler->name(), handler);
     }
 }
@@ -1,23 +1,61 @@
 #include "Environment.h"
+#include "Collector.h"
 #include "Types.h"
 
 #include <algorithm>
 
+static const SymbolId s_ampersand = internSymbol("&");
+
+const malValuePtr malEnv::s_unbound;
+
 malEnv::malEnv(malEnvPtr outer)
-: m_outer(outer)
+: m_outer(std::move(outer))
 {
     TRACE_ENV("Creating malEnv %p, outer=%p\n", this, m_outer.ptr());
+    setMayCycle();
 }
 
 malEnv::malEnv(malEnvPtr outer, const StringVec& bindings,
                malValueIter argsBegin, malValueIter argsEnd)
-: m_outer(outer)
+: m_outer(std::move(outer))
+{
+    TRACE_ENV("Creating malEnv %p, outer=%p\n", this, m_outer.ptr());
+    setMayCycle();
+    SymbolIdVec ids(bindings.size());
+    std::transform(bindings.begin(), bindings.end(), ids.begin(),
+                   internSymbol);
+    bind(ids, argsBegin, argsEnd);
+}
+
+malEnv::malEnv(malEnvPtr outer, const SymbolIdVec& bindings,
+               malValueIter argsBegin, malValueIter argsEnd)
+: m_outer(std::move(outer))
+{
+    TRACE_ENV("Creating malEnv %p, outer=%p\n", this, m_outer.ptr());
+    setMayCycle();
+    bind(bindings, argsBegin, argsEnd);
+}
+
+malEnv::malEnv(malEnvPtr outer, int slotCount)
+: m_slots(slotCount)
+, m_outer(std::move(outer))
 {
     TRACE_ENV("Creating malEnv %p, outer=%p\n", this, m_outer.ptr());
+    setMayCycle();
+}
+
+malEnv::~malEnv()
+{
+    TRACE_ENV("Destroying malEnv %p, outer=%p\n", this, m_outer.ptr());
+}
+
+void malEnv::bind(const SymbolIdVec& bindings,
+                  malValueIter argsBegin, malValueIter argsEnd)
+{
     int n = bindings.size();
     auto it = argsBegin;
     for (int i = 0; i < n; i++) {
-        if (bindings[i] == "&") {
+        if (bindings[i] == s_ampersand) {
             MAL_CHECK(i == n - 2, "There must be one parameter after the &");
 
             set(bindings[n-1], mal::list(it, argsEnd));
@@ -30,42 +68,122 @@ malEnv::malEnv(malEnvPtr outer, const StringVec& bindings,
     MAL_CHECK(it == argsEnd, "Too many parameters");
 }
 
-malEnv::~malEnv()
-{
-    TRACE_ENV("Destroying malEnv %p, outer=%p\n", this, m_outer.ptr());
-}
-
-malEnvPtr malEnv::find(const String& symbol)
+malEnvPtr malEnv::find(SymbolId symbol)
 {
-    for (malEnvPtr env = this; env; env = env->m_outer) {
-        if (env->m_map.find(symbol) != env->m_map.end()) {
+    for (malEnvRef env = this; env; env = env->m_outer) {
+        if (!env->m_outer) {
+            const auto& cells = env->m_cells;
+            if ((symbol < (int)cells.size()) && cells[symbol] &&
+                cells[symbol]->value()) {
+                return env;
+            }
+        }
+        else if (env->m_map.find(symbol) != env->m_map.end()) {
             return env;
         }
     }
     return NULL;
 }
 
-malValuePtr malEnv::get(const String& symbol)
+const malValuePtr& malEnv::get(SymbolId symbol)
 {
-    for (malEnvPtr env = this; env; env = env->m_outer) {
+    for (malEnvRef env = this; env; env = env->m_outer) {
+        if (!env->m_outer) {
+            const auto& cells = env->m_cells;
+            if ((symbol < (int)cells.size()) && cells[symbol] &&
+                cells[symbol]->value()) {
+                return cells[symbol]->value();
+            }
+            break;
+        }
         auto it = env->m_map.find(symbol);
         if (it != env->m_map.end()) {
             return it->second;
         }
     }
-    MAL_FAIL("'%s' not found", symbol.c_str());
+    MAL_FAIL("'%s' not found", symbolName(symbol).c_str());
 }
 
-malValuePtr malEnv::set(const String& symbol, malValuePtr value)
+malValuePtr malEnv::set(SymbolId symbol, malValuePtr value)
 {
-    m_map[symbol] = value;
+    if (!m_outer) {
+        cell(symbol)->set(value);
+    }
+    else {
+        m_map[symbol] = value;
+    }
     return value;
 }
 
+malCellPtr malEnv::cell(SymbolId symbol)
+{
+    ASSERT(!m_outer, "Only the root environment has cells\n");
+    if (symbol >= (int)m_cells.size()) {
+        m_cells.resize(symbol + 1);
+    }
+    malCellPtr& cell = m_cells[symbol];
+    if (!cell) {
+        cell = new malCell(symbol);
+        if (isImmortal()) {
+            // The cells of an environment that's never freed are never
+            // freed either, so code can share them without counting.
+            cell->makeImmortal();
+        }
+    }
+    return cell;
+}
+
+void malEnv::setSlot(int slot, malValuePtr value)
+{
+    // Expanding a macro late can add definitions to a frame in use.
+    if (slot >= (int)m_slots.size()) {
+        m_slots.resize(slot + 1);
+    }
+    m_slots[slot] = std::move(value);
+}
+
+void malEnv::traceRefs(malTracer& tracer) const
+{
+    for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
+        tracer(it->second);
+    }
+    tracer(m_cells);
+    tracer(m_slots);
+    tracer(m_outer);
+}
+
+void malEnv::dropRefs()
+{
+    m_map.clear();
+    m_cells.clear();
+    m_slots.clear();
+    m_outer = NULL;
+}
+
+void malCell::traceRefs(malTracer& tracer) const
+{
+    tracer(m_value);
+}
+
+malEnvPtr malEnv::find(const String& symbol)
+{
+    return find(internSymbol(symbol));
+}
+
+const malValuePtr& malEnv::get(const String& symbol)
+{
+    return get(internSymbol(symbol));
+}
+
+malValuePtr malEnv::set(const String& symbol, malValuePtr value)
+{
+    return set(internSymbol(symbol), value);
+}
+
 malEnvPtr malEnv::getRoot()
 {
     // Work our way down the the global environment.
-    for (malEnvPtr env = this; ; env = env->m_outer) {
+    for (malEnvRef env = this; ; env = env->m_outer) {
         if (!env->m_outer) {
             return env;
         }
@@ -2,28 +2,88 @@
 #define INCLUDE_ENVIRONMENT_H
 
 #include "MAL.h"
+#include "SymbolTable.h"
 
 #include <map>
 
+// A variable in the global environment. Cells stay put once created, so
+// code which refers to a global can look its cell up once and hold on to
+// it, and def! updates the cell in place. The value is NULL until the
+// variable is defined.
+class malCell : public RefCounted {
+public:
+    malCell(SymbolId id) : m_id(id) { setMayCycle(); }
+
+    SymbolId id() const { return m_id; }
+    const malValuePtr& value() const { return m_value; }
+    void set(malValuePtr value) { m_value = std::move(value); }
+
+    virtual void traceRefs(malTracer& tracer) const;
+    virtual void dropRefs() { m_value = malValuePtr(); }
+
+private:
+    const SymbolId m_id;
+    malValuePtr    m_value;
+};
+
+typedef RefCountedPtr<malCell> malCellPtr;
+
 class malEnv : public RefCounted {
 public:
+    POOL_ALLOCATED
+
     malEnv(malEnvPtr outer = NULL);
     malEnv(malEnvPtr outer,
            const StringVec& bindings,
            malValueIter argsBegin,
            malValueIter argsEnd);
+    malEnv(malEnvPtr outer,
+           const SymbolIdVec& bindings,
+           malValueIter argsBegin,
+           malValueIter argsEnd);
+
+    // A frame for an analysed fn*, let* or catch*. Its variables have been
+    // resolved to slot numbers, so they are kept in an array rather than
+    // looked up by name.
+    malEnv(malEnvPtr outer, int slotCount);
 
     ~malEnv();
 
-    malValuePtr get(const String& symbol);
+    const malValuePtr& get(SymbolId symbol);
+    malEnvPtr   find(SymbolId symbol);
+    malValuePtr set(SymbolId symbol, malValuePtr value);
+
+    const malValuePtr& get(const String& symbol);
     malEnvPtr   find(const String& symbol);
     malValuePtr set(const String& symbol, malValuePtr value);
     malEnvPtr   getRoot();
 
+    // The cell of a global, in the root environment.
+    malCellPtr  cell(SymbolId symbol);
+
+    const malValuePtr& getSlot(int slot) const {
+        return slot < (int)m_slots.size() ? m_slots[slot] : s_unbound;
+    }
+    void setSlot(int slot, malValuePtr value);
+    malEnv* outer() const { return m_outer.ptr(); }
+
+    virtual void traceRefs(malTracer& tracer) const;
+    virtual void dropRefs();
+
 private:
-    typedef std::map<String, malValuePtr> Map;
+    void bind(const SymbolIdVec& bindings,
+              malValueIter argsBegin, malValueIter argsEnd);
+
+    // The root environment keeps its variables in cells, indexed by id.
+    // Other environments are either frames with slots, or use a map.
+    typedef std::map<SymbolId, malValuePtr, std::less<SymbolId>,
+        malAllocator<std::pair<const SymbolId, malValuePtr> > > Map;
     Map m_map;
+    std::vector<malCellPtr> m_cells;
+    malValueVec m_slots;
     malEnvPtr m_outer;
+
+    static const malValuePtr s_unbound;
 };
 
 #endif // INCLUDE_ENVIRONMENT_H
@@ -0,0 +1,65 @@
+#include "FreeQueue.h"
+#include "RefCountedPtr.h"
+
+#include <new>
+#include <stdlib.h>
+
+namespace {
+    // Plain data, so it's ready before any static initialiser frees an
+    // object, and still there after the static destructors have run.
+    const RefCounted** s_queue;
+    size_t s_count;
+    size_t s_capacity;
+    size_t s_sliceSize;
+    bool   s_isFreeing;
+
+    void push(const RefCounted* object) {
+        if (s_count == s_capacity) {
+            size_t capacity = s_capacity ? 2 * s_capacity : 1024;
+            void* queue = realloc(s_queue, capacity * sizeof(*s_queue));
+            if (queue == NULL) {
+                throw std::bad_alloc();
+            }
+            s_queue = static_cast<const RefCounted**>(queue);
+            s_capacity = capacity;
+        }
+        s_queue[s_count++] = object;
+    }
+}
+
+void RefCounted::destroy() const
+{
+    if (s_isFreeing) {
+        push(this);
+        return;
+    }
+    s_isFreeing = true;
+    delete this;
+    s_isFreeing = false;
+    if (s_count > 0) {
+        malFreeQueue::drain(s_sliceSize);
+    }
+}
+
+// The queue is a stack, so a chain is freed depth first, and only ever
+// holds a few of its links at once.
+void malFreeQueue::drain(size_t limit)
+{
+    bool wasFreeing = s_isFreeing;
+    s_isFreeing = true;
+    for (size_t freed = 0;
+         (s_count > 0) && ((limit == 0) || (freed < limit)); freed++) {
+        delete s_queue[--s_count];
+    }
+    s_isFreeing = wasFreeing;
+}
+
+void malFreeQueue::setSliceSize(size_t size)
+{
+    s_sliceSize = size;
+}
+
+size_t malFreeQueue::sliceSize()
+{
+    return s_sliceSize;
+}
@@ -0,0 +1,25 @@
+#ifndef INCLUDE_FREEQUEUE_H
+#define INCLUDE_FREEQUEUE_H
+
+#include <cstddef>
+
+// Deleting an object releases everything it refers to, which can delete
+// those in turn. Done recursively, freeing a long chain of nested lists
+// runs out of stack, so objects whose counts reach zero while another is
+// being deleted are queued instead, and deleted one at a time once it's
+// done.
+//
+// With a slice size set, freeing stops after that many objects, leaving
+// the rest queued. Each later release to zero frees another slice, as does
+// the REPL between forms, so dropping a huge structure doesn't stall
+// whoever dropped it.
+namespace malFreeQueue {
+    // Deletes up to limit queued objects, or all of them if it's 0.
+    void   drain(size_t limit);
+
+    // How many objects each release to zero frees at most, or 0 for all.
+    void   setSliceSize(size_t size);
+    size_t sliceSize();
+};
+
+#endif // INCLUDE_FREEQUEUE_H
@@ -0,0 +1,221 @@
+#include "HashTrie.h"
+#include "Collector.h"
+#include "Types.h"
+
+
+static const int BITS      = malHashTrieNode::BITS;
+static const int MASK      = malHashTrieNode::MASK;
+static const int HASH_BITS = 8 * sizeof(size_t);
+
+static size_t hashOf(const malHashKey& key)
+{
+    return key.hash();
+}
+
+static bool isKey(const malHashEntry& entry,
+                  const malHashKey& key, size_t hash)
+{
+    return (entry.hash == hash) && entry.key.isEqualTo(key);
+}
+
+static uint32_t positionBit(size_t hash, int shift)
+{
+    return 1u << ((hash >> shift) & MASK);
+}
+
+// Where the item for a position goes, among those present in the map.
+static int indexOf(uint32_t map, uint32_t bit)
+{
+    return __builtin_popcount(map & (bit - 1));
+}
+
+// Small maps keep their root at this shift, too.
+static bool isCollisionNode(int shift)
+{
+    return shift >= HASH_BITS;
+}
+
+// Gets a node that can be changed without anyone else seeing: the node
+// itself if this is the only reference to it, otherwise a copy, which
+// replaces it. A missing node is created empty.
+static malHashTrieNode* editable(malHashTrieNodePtr& node)
+{
+    if (!node) {
+        node = new malHashTrieNode;
+    }
+    else if (node->refCount() != 1) {
+        malHashTrieNode* copy = new malHashTrieNode;
+        copy->entryMap = node->entryMap;
+        copy->childMap = node->childMap;
+        copy->entries  = node->entries;
+        copy->children = node->children;
+        if (node->mayCycle()) {
+            copy->setMayCycle();
+        }
+        node = copy;
+    }
+    return node.ptr();
+}
+
+// Returns true if the key is new.
+static bool setIn(malHashTrieNodePtr& slot, int shift, malHashEntry entry)
+{
+    malHashTrieNode* node = editable(slot);
+    auto& entries = node->entries;
+    if (entry.key.mayCycle() || entry.value.mayCycle()) {
+        node->setMayCycle();
+    }
+
+    if (isCollisionNode(shift)) {
+        for (auto it = entries.begin(), end = entries.end(); it != end; ++it) {
+            if (isKey(*it, entry.key, entry.hash)) {
+                it->value = std::move(entry.value);
+                return false;
+            }
+        }
+        entries.push_back(std::move(entry));
+        return true;
+    }
+
+    uint32_t bit = positionBit(entry.hash, shift);
+    if (node->childMap & bit) {
+        return setIn(node->children[indexOf(node->childMap, bit)],
+                     shift + BITS, std::move(entry));
+    }
+
+    int index = indexOf(node->entryMap, bit);
+    if (!(node->entryMap & bit)) {
+        entries.insert(entries.begin() + index, std::move(entry));
+        node->entryMap |= bit;
+        return true;
+    }
+    if (isKey(entries[index], entry.key, entry.hash)) {
+        entries[index].value = std::move(entry.value);
+        return false;
+    }
+
+    // Two keys want the same position, so they both move down a level.
+    malHashTrieNodePtr child;
+    setIn(child, shift + BITS, std::move(entries[index]));
+    setIn(child, shift + BITS, std::move(entry));
+    entries.erase(entries.begin() + index);
+    node->entryMap ^= bit;
+    node->children.insert(node->children.begin()
+                          + indexOf(node->childMap, bit), std::move(child));
+    node->childMap |= bit;
+    return true;
+}
+
+// The key must be present.
+static void eraseIn(malHashTrieNodePtr& slot, int shift,
+                    const malHashKey& key, size_t hash)
+{
+    malHashTrieNode* node = editable(slot);
+    auto& entries = node->entries;
+
+    if (isCollisionNode(shift)) {
+        for (auto it = entries.begin(), end = entries.end(); it != end; ++it) {
+            if (isKey(*it, key, hash)) {
+                entries.erase(it);
+                break;
+            }
+        }
+    }
+    else {
+        uint32_t bit = positionBit(hash, shift);
+        if (node->entryMap & bit) {
+            entries.erase(entries.begin() + indexOf(node->entryMap, bit));
+            node->entryMap ^= bit;
+        }
+        else {
+            int childIndex = indexOf(node->childMap, bit);
+            malHashTrieNodePtr& child = node->children[childIndex];
+            eraseIn(child, shift + BITS, key, hash);
+
+            // A child left with a single entry gives it back to this node.
+            if (child && child->children.empty()
+                      && child->entries.size() == 1) {
+                entries.insert(entries.begin()
+                               + indexOf(node->entryMap, bit),
+                               child->entries[0]);
+                node->entryMap |= bit;
+                child = NULL;
+            }
+            if (!child) {
+                node->children.erase(node->children.begin() + childIndex);
+                node->childMap ^= bit;
+            }
+        }
+    }
+
+    if (entries.empty() && node->children.empty()) {
+        slot = NULL;
+    }
+}
+
+const malValuePtr* malHashTrie::find(const malHashKey& key) const
+{
+    size_t hash = hashOf(key);
+    const malHashTrieNode* node = m_root.ptr();
+    for (int shift = m_rootShift; node; shift += BITS) {
+        if (isCollisionNode(shift)) {
+            for (auto it = node->entries.begin(), end = node->entries.end();
+                 it != end; ++it) {
+                if (isKey(*it, key, hash)) {
+                    return &it->value;
+                }
+            }
+            return NULL;
+        }
+        uint32_t bit = positionBit(hash, shift);
+        if (node->entryMap & bit) {
+            const malHashEntry& entry =
+                node->entries[indexOf(node->entryMap, bit)];
+            return isKey(entry, key, hash) ? &entry.value : NULL;
+        }
+        if (!(node->childMap & bit)) {
+            return NULL;
+        }
+        node = node->children[indexOf(node->childMap, bit)].ptr();
+    }
+    return NULL;
+}
+
+void malHashTrie::set(const malHashKey& key, malValuePtr value)
+{
+    if ((m_rootShift != 0) && (m_count == LINEAR_LIMIT) && !find(key)) {
+        malHashTrieNodePtr root;
+        forEach([&root](const malHashEntry& entry) {
+            setIn(root, 0, entry);
+        });
+        m_root = std::move(root);
+        m_rootShift = 0;
+    }
+
+    malHashEntry entry = { key, std::move(value), hashOf(key) };
+    if (setIn(m_root, m_rootShift, std::move(entry))) {
+        m_count++;
+    }
+}
+
+void malHashTrie::erase(const malHashKey& key)
+{
+    if (find(key)) {
+        eraseIn(m_root, m_rootShift, key, hashOf(key));
+        m_count--;
+    }
+}
+
+void malHashTrie::traceRefs(malTracer& tracer) const
+{
+    tracer(m_root);
+}
+
+void malHashTrieNode::traceRefs(malTracer& tracer) const
+{
+    for (auto it = entries.begin(), end = entries.end(); it != end; ++it) {
+        tracer(it->key);
+        tracer(it->value);
+    }
+    tracer(children);
+}
@@ -0,0 +1,97 @@
+#ifndef INCLUDE_HASHTRIE_H
+#define INCLUDE_HASHTRIE_H
+
+#include "MAL.h"
+
+#include <stdint.h>
+
+typedef malValuePtr malHashKey;
+
+// Entries hold the key objects they were given, along with their hashes.
+struct malHashEntry {
+    malHashKey  key;
+    malValuePtr value;
+    size_t      hash;
+};
+
+// The entries of a hash-map, in a persistent hash array mapped trie. Each
+// node takes 5 bits of the key's hash to choose one of 32 positions, which
+// is empty, or holds an entry, or holds a node for the next 5 bits. Nodes
+// only store the positions in use, with bitmaps to say which those are.
+// Keys whose whole hashes match share a collision node, searched in turn.
+//
+// Small maps are a single collision node, which keeps their entries in the
+// order they were added, like the sorted maps used to print. Once one grows
+// past LINEAR_LIMIT entries, it becomes a trie.
+//
+// Changing a copy copies only the nodes on the key's path, so assoc and
+// dissoc are O(log32 n) and share the rest with the original. As with the
+// vector trie, a node which nothing else refers to is changed in place, and
+// nodes are marked for the cycle collector on the way to an entry that may
+// be part of a cycle.
+class malHashTrieNode : public RefCounted {
+public:
+    POOL_ALLOCATED
+
+    static const int BITS = 5;
+    static const int MASK = (1 << BITS) - 1;
+
+    typedef std::vector<malHashEntry, malAllocator<malHashEntry> > EntryVec;
+    typedef RefCountedPtr<malHashTrieNode> NodePtr;
+    typedef std::vector<NodePtr, malAllocator<NodePtr> > NodeVec;
+
+    malHashTrieNode() : entryMap(0), childMap(0) { }
+
+    virtual void traceRefs(malTracer& tracer) const;
+
+    uint32_t    entryMap;   // the positions holding entries
+    uint32_t    childMap;   // the positions holding nodes
+    EntryVec    entries;    // in position order
+    NodeVec     children;   // in position order
+};
+
+typedef RefCountedPtr<malHashTrieNode> malHashTrieNodePtr;
+
+class malHashTrie {
+public:
+    malHashTrie() : m_count(0), m_rootShift(LINEAR_SHIFT) { }
+
+    int count() const { return m_count; }
+
+    // The value for a key, or NULL if it's not there.
+    const malValuePtr* find(const malHashKey& key) const;
+
+    void set(const malHashKey& key, malValuePtr value);
+    void erase(const malHashKey& key);
+
+    bool mayCycle() const { return m_root && m_root->mayCycle(); }
+    void traceRefs(malTracer& tracer) const;
+
+    template<class Fn> void forEach(Fn fn) const {
+        if (m_root) {
+            visit(m_root.ptr(), fn);
+        }
+    }
+
+private:
+    template<class Fn>
+    static void visit(const malHashTrieNode* node, Fn& fn) {
+        for (auto it = node->entries.begin(), end = node->entries.end();
+             it != end; ++it) {
+            fn(*it);
+        }
+        for (auto it = node->children.begin(), end = node->children.end();
+             it != end; ++it) {
+            visit(it->ptr(), fn);
+        }
+    }
+
+    static const int LINEAR_LIMIT = 8;
+    static const int LINEAR_SHIFT = 8 * sizeof(size_t);
+
+    malHashTrieNodePtr  m_root;
+    int                 m_count;
+    int                 m_rootShift;    // LINEAR_SHIFT until it's a trie
+};
+
+#endif // INCLUDE_HASHTRIE_H
@@ -2,22 +2,24 @@
 #define INCLUDE_MAL_H
 
 #include "Debug.h"
+#include "Pool.h"
 #include "RefCountedPtr.h"
 #include "String.h"
 #include "Validation.h"
+#include "ValuePtr.h"
 
 #include <vector>
 
-class malValue;
-typedef RefCountedPtr<malValue>  malValuePtr;
-typedef std::vector<malValuePtr> malValueVec;
-typedef malValueVec::iterator    malValueIter;
+typedef std::vector<malValuePtr, malAllocator<malValuePtr> > malValueVec;
+// Arguments, and the items of sequences, are contiguous arrays.
+typedef malValuePtr*             malValueIter;
 
 class malEnv;
 typedef RefCountedPtr<malEnv>     malEnvPtr;
+typedef BorrowedPtr<malEnv>       malEnvRef;
 
 // step*.cpp
-extern malValuePtr APPLY(malValuePtr op,
+extern malValuePtr APPLY(const malValuePtr& op,
                          malValueIter argsBegin, malValueIter argsEnd);
 extern malValuePtr EVAL(malValuePtr ast, malEnvPtr env);
 extern malValuePtr readline(const String& prompt);
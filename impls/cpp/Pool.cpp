@@ -0,0 +1,109 @@
+#include "Pool.h"
+
+#include <new>
+#include <stdlib.h>
+
+namespace {
+    const size_t GRANULE     = 16;
+    const size_t CLASS_COUNT = 32;                  // up to 512 bytes
+    const size_t CHUNK_SIZE  = 64 * 1024;
+
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    struct SizeClass {
+        FreeBlock*  freeList;
+        char*       next;           // the unused part of the current chunk
+        char*       end;
+        size_t      allocations;
+        size_t      hits;           // allocations taken from freeList
+        size_t      chunks;
+    };
+
+    // Plain data, so it's ready before any static initialiser allocates.
+    SizeClass s_classes[CLASS_COUNT];
+    size_t    s_largeAllocations;
+
+    // Sizes of 0 wrap round to a large class, and go to operator new.
+    size_t classOf(size_t size) {
+        return (size + GRANULE - 1) / GRANULE - 1;
+    }
+}
+
+void* malPool::allocate(size_t size)
+{
+    size_t index = classOf(size);
+    if (index >= CLASS_COUNT) {
+        s_largeAllocations++;
+        return ::operator new(size);
+    }
+
+    SizeClass& sc = s_classes[index];
+    sc.allocations++;
+    if (FreeBlock* block = sc.freeList) {
+        sc.freeList = block->next;
+        sc.hits++;
+        return block;
+    }
+
+    size_t blockSize = (index + 1) * GRANULE;
+    if (sc.end - sc.next < (ptrdiff_t)blockSize) {
+        // Chunks are never given back, as their blocks are all recycled.
+        sc.next = static_cast<char*>(::operator new(CHUNK_SIZE));
+        sc.end = sc.next + CHUNK_SIZE - CHUNK_SIZE % blockSize;
+        sc.chunks++;
+    }
+    void* block = sc.next;
+    sc.next += blockSize;
+    return block;
+}
+
+void malPool::release(void* block, size_t size)
+{
+    if (block == NULL) {
+        return;
+    }
+    size_t index = classOf(size);
+    if (index >= CLASS_COUNT) {
+        ::operator delete(block);
+        return;
+    }
+
+    FreeBlock* freed = static_cast<FreeBlock*>(block);
+    freed->next = s_classes[index].freeList;
+    s_classes[index].freeList = freed;
+}
+
+void* malPool::allocateVariable(size_t size)
+{
+    size_t* block = static_cast<size_t*>(allocate(size + sizeof(size_t)));
+    *block = size + sizeof(size_t);
+    return block + 1;
+}
+
+void malPool::releaseVariable(void* block)
+{
+    if (block == NULL) {
+        return;
+    }
+    size_t* start = static_cast<size_t*>(block) - 1;
+    release(start, *start);
+}
+
+void malPool::report(FILE* out)
+{
+    fprintf(out, "%6s %12s %12s %7s %7s\n",
+            "size", "allocations", "reused", "hit %", "chunks");
+    for (size_t i = 0; i < CLASS_COUNT; i++) {
+        const SizeClass& sc = s_classes[i];
+        if (sc.allocations == 0) {
+            continue;
+        }
+        fprintf(out, "%6zu %12zu %12zu %6.1f%% %7zu\n",
+                (i + 1) * GRANULE, sc.allocations, sc.hits,
+                100.0 * sc.hits / sc.allocations, sc.chunks);
+    }
+    fprintf(out, "larger than %zu bytes: %zu\n",
+            CLASS_COUNT * GRANULE, s_largeAllocations);
+}
@@ -0,0 +1,73 @@
+#ifndef INCLUDE_POOL_H
+#define INCLUDE_POOL_H
+
+#include <cstddef>
+#include <memory>
+#include <stdio.h>
+
+// Building with POOL=1 allocates values, environments and the containers
+// inside environments from pools, one per size class. Each pool carves its
+// blocks out of large chunks, and keeps freed blocks on a list to hand out
+// again, so the many small, short-lived objects of an evaluation don't go
+// through malloc, and don't fragment the heap between objects of other
+// sizes. The interpreter is single-threaded, and so are the pools.
+namespace malPool {
+    void* allocate(size_t size);
+    void  release(void* block, size_t size);
+
+    // For objects with a trailing array, whose size isn't known when
+    // they're deleted: the block records its own size in front of it.
+    void* allocateVariable(size_t size);
+    void  releaseVariable(void* block);
+
+    // Writes the allocation counts and free-list hit rate of each size
+    // class that has been used.
+    void  report(FILE* out);
+};
+
+#if MAL_USE_POOL
+
+// Gives a class, and its subclasses, pooled allocation.
+#define POOL_ALLOCATED \
+    static void* operator new(size_t size) { \
+        return malPool::allocate(size); \
+    } \
+    static void operator delete(void* block, size_t size) { \
+        malPool::release(block, size); \
+    }
+
+// An allocator for standard containers, which takes their nodes and
+// arrays from the pools.
+template<class T>
+class malAllocator {
+public:
+    typedef T value_type;
+
+    malAllocator() { }
+    template<class U> malAllocator(const malAllocator<U>&) { }
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(malPool::allocate(n * sizeof(T)));
+    }
+    void deallocate(T* p, size_t n) {
+        malPool::release(p, n * sizeof(T));
+    }
+
+    template<class U> bool operator == (const malAllocator<U>&) const {
+        return true;
+    }
+    template<class U> bool operator != (const malAllocator<U>&) const {
+        return false;
+    }
+};
+
+#else
+
+#define POOL_ALLOCATED
+
+template<class T>
+using malAllocator = std::allocator<T>;
+
+#endif
+
+#endif // INCLUDE_POOL_H
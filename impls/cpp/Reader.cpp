@@ -116,7 +116,7 @@ static malValuePtr readAtom(Tokeniser& tokeniser);
 static malValuePtr readForm(Tokeniser& tokeniser);
 static void readList(Tokeniser& tokeniser, malValueVec* items,
                       const String& end);
-static malValuePtr processMacro(Tokeniser& tokeniser, const String& symbol);
+static malValuePtr processMacro(Tokeniser& tokeniser, SymbolId symbol);
 
 malValuePtr readStr(const String& input)
 {
@@ -151,7 +151,7 @@ static malValuePtr readForm(Tokeniser& tokeniser)
         tokeniser.next();
         malValueVec items;
         readList(tokeniser, &items, "}");
-        return mal::hash(items.begin(), items.end(), false);
+        return mal::hash(items.data(), items.data() + items.size(), false);
     }
     return readAtom(tokeniser);
 }
@@ -160,15 +160,16 @@ static malValuePtr readAtom(Tokeniser& tokeniser)
 {
     struct ReaderMacro {
         const char* token;
-        const char* symbol;
+        SymbolId    symbol;
     };
-    ReaderMacro macroTable[] = {
-        { "@",   "deref" },
-        { "`",   "quasiquote" },
-        { "'",   "quote" },
-        { "~@",  "splice-unquote" },
-        { "~",   "unquote" },
+    static const ReaderMacro macroTable[] = {
+        { "@",   internSymbol("deref") },
+        { "`",   internSymbol("quasiquote") },
+        { "'",   internSymbol("quote") },
+        { "~@",  internSymbol("splice-unquote") },
+        { "~",   internSymbol("unquote") },
     };
+    static const SymbolId withMeta = internSymbol("with-meta");
 
     struct Constant {
         const char* token;
@@ -191,7 +192,7 @@ static malValuePtr readAtom(Tokeniser& tokeniser)
         malValuePtr meta = readForm(tokeniser);
         malValuePtr value = readForm(tokeniser);
         // Note that meta and value switch places
-        return mal::list(mal::symbol("with-meta"), value, meta);
+        return mal::list(mal::symbol(withMeta), value, meta);
     }
     for (auto &constant : constantTable) {
         if (token == constant.token) {
@@ -222,7 +223,7 @@ static void readList(Tokeniser& tokeniser, malValueVec* items,
     }
 }
 
-static malValuePtr processMacro(Tokeniser& tokeniser, const String& symbol)
+static malValuePtr processMacro(Tokeniser& tokeniser, SymbolId symbol)
 {
     return mal::list(mal::symbol(symbol), readForm(tokeniser));
 }
@@ -4,21 +4,131 @@
 #include "Debug.h"
 
 #include <cstddef>
+#include <utility>
+
+#if DEBUG_REFCOUNT_OPS
+    // The number of refcount changes so far, to measure what code costs.
+    inline unsigned long long& refCountOps() {
+        static unsigned long long ops = 0;
+        return ops;
+    }
+    #define COUNT_REFCOUNT_OP() (refCountOps()++)
+#else
+    #define COUNT_REFCOUNT_OP() NOOP
+#endif
+
+class malTracer;
 
 class RefCounted {
 public:
-    RefCounted() : m_refCount(0) { }
-    virtual ~RefCounted() { }
+    RefCounted()
+        : m_refCount(0), m_color(0), m_isBuffered(false), m_mayCycle(false)
+    { }
+    virtual ~RefCounted() {
+#if MAL_GENERATIONAL_CYCLES
+        if (m_mayCycle) {
+            untrack();
+        }
+#endif
+    }
+
+    const RefCounted* acquire() const {
+        COUNT_REFCOUNT_OP();
+        m_refCount++;
+        return this;
+    }
 
-    const RefCounted* acquire() const { m_refCount++; return this; }
-    int release() const { return --m_refCount; }
+    // Drops a reference, and frees the object if it was the last. Any
+    // remaining references to an object that can be part of a cycle might
+    // all come from garbage, so it becomes a candidate for the cycle
+    // collector, which deals with it if the count reaches zero later.
+    //
+    // The generational collector doesn't need candidates, as it looks at
+    // all the objects that can be part of a cycle, youngest most often.
+    void release() const {
+        COUNT_REFCOUNT_OP();
+#if MAL_GENERATIONAL_CYCLES
+        if (--m_refCount == 0) {
+            destroy();
+        }
+#else
+        if (--m_refCount == 0) {
+            if (!m_isBuffered) {
+                destroy();
+            }
+            else {
+                releaseCandidate();
+            }
+        }
+        else if (m_mayCycle && !m_isBuffered) {
+            addCandidate();
+        }
+#endif
+    }
     int refCount() const { return m_refCount; }
 
+    // Objects which live for the rest of the run can be made immortal.
+    // References to them are no longer counted, and they're never freed.
+    void makeImmortal() const {
+#if MAL_GENERATIONAL_CYCLES
+        if (m_mayCycle) {
+            untrack();
+        }
+#endif
+        m_refCount = IMMORTAL;
+        m_mayCycle = false;
+    }
+    bool isImmortal() const { return m_refCount == IMMORTAL; }
+
+    // Only objects which are, or can hold references to, environments,
+    // lambdas and atoms can be part of a cycle. The cycle collector
+    // (Collector.h) ignores the rest.
+    bool mayCycle() const { return m_mayCycle; }
+    void setMayCycle() const {
+        if (!m_mayCycle && !isImmortal()) {
+            m_mayCycle = true;
+#if MAL_GENERATIONAL_CYCLES
+            track();
+#endif
+        }
+    }
+
+    // Calls the tracer with each counted reference the object holds, so the
+    // cycle collector can follow them.
+    virtual void traceRefs(malTracer& tracer) const { }
+
+    // Drops the references held by a garbage object which can be changed
+    // after it's made, which is what breaks the cycles it's part of.
+    virtual void dropRefs() { }
+
 private:
     RefCounted(const RefCounted&); // no copy ctor
     RefCounted& operator = (const RefCounted&); // no assignments
 
+    // FreeQueue.cpp
+    void destroy() const;
+
+    // Collector.cpp
+    void addCandidate() const;
+    void releaseCandidate() const;
+    void track() const;
+    void untrack() const;
+
+    static const int IMMORTAL = -1;
+
     mutable int m_refCount;
+
+    // The state of the cycle collector.
+    mutable unsigned char m_color;
+    mutable bool m_isBuffered;
+    mutable bool m_mayCycle;
+#if MAL_GENERATIONAL_CYCLES
+    mutable unsigned char m_generation;
+    mutable const RefCounted* m_prev;   // in the list of its generation
+    mutable const RefCounted* m_next;
+#endif
+
+    friend class malCollector;
 };
 
 template<class T>
@@ -32,11 +142,23 @@ public:
     RefCountedPtr(const RefCountedPtr& rhs) : m_object(0)
     { acquire(rhs.m_object); }
 
+    // Moving takes over the count of rhs, and leaves it NULL.
+    RefCountedPtr(RefCountedPtr&& rhs) : m_object(rhs.m_object)
+    { rhs.m_object = NULL; }
+
     const RefCountedPtr& operator = (const RefCountedPtr& rhs) {
         acquire(rhs.m_object);
         return *this;
     }
 
+    const RefCountedPtr& operator = (RefCountedPtr&& rhs) {
+        T* old = m_object;
+        m_object = rhs.m_object;
+        rhs.m_object = NULL;
+        release(old);
+        return *this;
+    }
+
     bool operator == (const RefCountedPtr& rhs) const {
         return m_object == rhs.m_object;
     }
@@ -50,7 +172,7 @@ public:
     }
 
     ~RefCountedPtr() {
-        release();
+        release(m_object);
     }
 
     T* operator -> () const { return m_object; }
@@ -58,20 +180,54 @@ public:
 
 private:
     void acquire(T* object) {
-        if (object != NULL) {
+        if ((object != NULL) && !object->isImmortal()) {
             object->acquire();
         }
-        release();
+        T* old = m_object;
         m_object = object;
+        release(old);
     }
 
-    void release() {
-        if ((m_object != NULL) && (m_object->release() == 0)) {
-            delete m_object;
+    static void release(T* object) {
+        if ((object != NULL) && !object->isImmortal()) {
+            object->release();
         }
     }
 
     T* m_object;
 };
 
+// A reference which doesn't hold a count, for passing an object down the
+// stack while something else keeps it alive. It turns back into a
+// RefCountedPtr wherever the object needs to be kept.
+template<class T>
+class BorrowedPtr {
+public:
+    BorrowedPtr() : m_object(NULL) { }
+    BorrowedPtr(T* object) : m_object(object) { }
+    BorrowedPtr(const RefCountedPtr<T>& rhs) : m_object(rhs.ptr()) { }
+
+    operator RefCountedPtr<T> () const {
+        return RefCountedPtr<T>(m_object);
+    }
+
+    bool operator == (const BorrowedPtr& rhs) const {
+        return m_object == rhs.m_object;
+    }
+
+    bool operator != (const BorrowedPtr& rhs) const {
+        return m_object != rhs.m_object;
+    }
+
+    operator bool () const {
+        return m_object != NULL;
+    }
+
+    T* operator -> () const { return m_object; }
+    T* ptr() const { return m_object; }
+
+private:
+    T* m_object;
+};
+
 #endif // INCLUDE_REFCOUNTEDPTR_H
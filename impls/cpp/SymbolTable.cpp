@@ -0,0 +1,46 @@
+#include "SymbolTable.h"
+#include "Debug.h"
+
+#include <unordered_map>
+
+namespace {
+    struct SymbolTable {
+        typedef std::unordered_map<String, SymbolId> Map;
+
+        Map                         ids;
+        std::vector<const String*>  names; // keys of ids, which are stable
+    };
+
+    // Function-local so that symbols can be interned by static initialisers
+    // in other translation units.
+    SymbolTable& table() {
+        static SymbolTable t;
+        return t;
+    }
+}
+
+SymbolId internSymbol(const String& name)
+{
+    SymbolTable& t = table();
+    auto it = t.ids.find(name);
+    if (it != t.ids.end()) {
+        return it->second;
+    }
+
+    SymbolId id = t.names.size();
+    it = t.ids.insert(std::make_pair(name, id)).first;
+    t.names.push_back(&it->first);
+    return id;
+}
+
+const String& symbolName(SymbolId id)
+{
+    SymbolTable& t = table();
+    ASSERT(id >= 0 && id < (int)t.names.size(), "Invalid symbol id %d\n", id);
+    return *t.names[id];
+}
+
+int symbolCount()
+{
+    return table().names.size();
+}
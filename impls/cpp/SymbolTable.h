@@ -0,0 +1,18 @@
+#ifndef INCLUDE_SYMBOLTABLE_H
+#define INCLUDE_SYMBOLTABLE_H
+
+#include "String.h"
+
+#include <vector>
+
+typedef int                     SymbolId;
+typedef std::vector<SymbolId>   SymbolIdVec;
+
+// Symbol names are interned into a single global table, so that each
+// distinct name maps to a small, dense integer id. Ids are never reused,
+// and the name for an id stays valid for the lifetime of the program.
+extern SymbolId internSymbol(const String& name);
+extern const String& symbolName(SymbolId id);
+extern int symbolCount();
+
+#endif // INCLUDE_SYMBOLTABLE_H
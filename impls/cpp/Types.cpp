@@ -1,32 +1,25 @@
+#include "Collector.h"
 #include "Debug.h"
 #include "Environment.h"
 #include "Types.h"
 
 #include <algorithm>
+#include <iterator>
 #include <memory>
-#include <typeinfo>
+#include <unordered_map>
 
 namespace mal {
     malValuePtr atom(malValuePtr value) {
-        return malValuePtr(new malAtom(value));
+        return malValuePtr(new malAtom(std::move(value)));
     };
 
-    malValuePtr boolean(bool value) {
-        return value ? trueValue() : falseValue();
-    }
-
     malValuePtr builtin(const String& name, malBuiltIn::ApplyFunc handler) {
         return malValuePtr(new malBuiltIn(name, handler));
     };
 
-    malValuePtr falseValue() {
-        static malValuePtr c(new malConstant("false"));
-        return malValuePtr(c);
-    };
-
 
-    malValuePtr hash(const malHash::Map& map) {
-        return malValuePtr(new malHash(map));
+    malValuePtr hash(malHashTrie map) {
+        return malValuePtr(new malHash(std::move(map)));
     }
 
     malValuePtr hash(malValueIter argsBegin, malValueIter argsEnd,
@@ -34,133 +27,285 @@ namespace mal {
         return malValuePtr(new malHash(argsBegin, argsEnd, isEvaluated));
     }
 
-    malValuePtr integer(int64_t value) {
-        return malValuePtr(new malInteger(value));
-    };
-
     malValuePtr integer(const String& token) {
         return integer(std::stoi(token));
     };
 
     malValuePtr keyword(const String& token) {
-        return malValuePtr(new malKeyword(token));
+        // Each keyword has the one object, which lives for the rest of the
+        // run, so keywords compare by address and hash without rehashing.
+        static std::unordered_map<String, malKeyword*> keywords;
+        malKeyword*& keyword = keywords[token];
+        if (!keyword) {
+            keyword = new malKeyword(token);
+            keyword->makeImmortal();
+            keyword->hash();
+        }
+        return malValuePtr(keyword);
     };
 
     malValuePtr lambda(const StringVec& bindings,
                        malValuePtr body, malEnvPtr env) {
-        return malValuePtr(new malLambda(bindings, body, env));
+        return malValuePtr(new malLambda(bindings, std::move(body),
+                                         std::move(env)));
+    }
+
+    malValuePtr lambda(const SymbolIdVec& bindings,
+                       malValuePtr body, malEnvPtr env, malCodePtr code) {
+        return malValuePtr(new malLambda(bindings, std::move(body),
+                                         std::move(env), std::move(code)));
     }
 
     malValuePtr list(malValueVec* items) {
-        return malValuePtr(new malList(items));
+        return malValuePtr(new (items->size()) malList(items));
     };
 
     malValuePtr list(malValueIter begin, malValueIter end) {
-        return malValuePtr(new malList(begin, end));
+        return malValuePtr(new (end - begin) malList(begin, end));
     };
 
     malValuePtr list(malValuePtr a) {
-        malValueVec* items = new malValueVec(1);
-        items->at(0) = a;
-        return malValuePtr(new malList(items));
+        return malValuePtr(new (1) malList(&a, &a + 1));
     }
 
     malValuePtr list(malValuePtr a, malValuePtr b) {
-        malValueVec* items = new malValueVec(2);
-        items->at(0) = a;
-        items->at(1) = b;
-        return malValuePtr(new malList(items));
+        malValuePtr items[] = { std::move(a), std::move(b) };
+        return malValuePtr(new (2) malList(items, items + 2));
     }
 
     malValuePtr list(malValuePtr a, malValuePtr b, malValuePtr c) {
-        malValueVec* items = new malValueVec(3);
-        items->at(0) = a;
-        items->at(1) = b;
-        items->at(2) = c;
-        return malValuePtr(new malList(items));
+        malValuePtr items[] = { std::move(a), std::move(b), std::move(c) };
+        return malValuePtr(new (3) malList(items, items + 3));
     }
 
     malValuePtr macro(const malLambda& lambda) {
         return malValuePtr(new malLambda(lambda, true));
     };
 
-    malValuePtr nilValue() {
-        static malValuePtr c(new malConstant("nil"));
-        return malValuePtr(c);
-    };
-
     malValuePtr string(const String& token) {
         return malValuePtr(new malString(token));
     }
 
     malValuePtr symbol(const String& token) {
-        return malValuePtr(new malSymbol(token));
+        return malValuePtr(new malSymbol(internSymbol(token)));
     };
 
-    malValuePtr trueValue() {
-        static malValuePtr c(new malConstant("true"));
-        return malValuePtr(c);
+    malValuePtr symbol(SymbolId id) {
+        return malValuePtr(new malSymbol(id));
     };
 
     malValuePtr vector(malValueVec* items) {
-        return malValuePtr(new malVector(items));
+        return malValuePtr(new (items->size()) malVector(items));
     };
 
     malValuePtr vector(malValueIter begin, malValueIter end) {
-        return malValuePtr(new malVector(begin, end));
+        return malValuePtr(new (end - begin) malVector(begin, end));
     };
 };
 
+static malValue* immortal(malValue* value)
+{
+    value->makeImmortal();
+    return value;
+}
+
+malValue* malValuePtr::constantObject(uintptr_t word)
+{
+    static malValue* const constants[CONSTANT_COUNT] = {
+        immortal(new malConstant("nil",   CONST_NIL)),
+        immortal(new malConstant("true",  CONST_TRUE)),
+        immortal(new malConstant("false", CONST_FALSE)),
+    };
+    return constants[word >> 3];
+}
+
+malValuePtr malValuePtr::boxInteger(int64_t value)
+{
+    return malValuePtr(new malInteger(value));
+}
+
+bool malValuePtr::isEqualTo(const malValuePtr& rhs) const
+{
+    if (m_word == rhs.m_word) {
+        return true;
+    }
+    malType lhsType = type(), rhsType = rhs.type();
+    if ((lhsType == MAL_INTEGER) || (rhsType == MAL_INTEGER)) {
+        return (lhsType == rhsType) && (intValue() == rhs.intValue());
+    }
+    return ptr()->isEqualTo(rhs.ptr());
+}
+
+int64_t integer_cast(const malValuePtr& obj)
+{
+    MAL_CHECK(obj.type() == MAL_INTEGER, "%s is not a malInteger",
+              obj->print(true).c_str());
+    return obj.intValue();
+}
+
 malValuePtr malBuiltIn::apply(malValueIter argsBegin,
                               malValueIter argsEnd) const
 {
     return m_handler(m_name, argsBegin, argsEnd);
 }
 
-static String makeHashKey(malValuePtr key)
+// Queues up the items of two containers of the same kind to be compared,
+// or returns false if they're already known to differ.
+static bool compareItems(const malValue* lhs, const malValue* rhs,
+                         malComparisons& pending)
+{
+    if (malSequence::hasType(lhs->type())) {
+        return static_cast<const malSequence*>(lhs)
+            ->compareItems(static_cast<const malSequence*>(rhs), pending);
+    }
+    return static_cast<const malHash*>(lhs)
+        ->compareItems(static_cast<const malHash*>(rhs), pending);
+}
+
+// Compares two sequences or two hash-maps. Nested containers are opened up
+// on a list of comparisons to make, rather than by recursion, so that
+// deeply nested data can't overflow the stack. Shared items are skipped,
+// without looking inside.
+static bool containersEqual(const malValue* lhs, const malValue* rhs)
+{
+    malComparisons pending;
+    if (!compareItems(lhs, rhs, pending)) {
+        return false;
+    }
+    while (!pending.empty()) {
+        const malValuePtr& a = *pending.back().first;
+        const malValuePtr& b = *pending.back().second;
+        pending.pop_back();
+
+        if (a == b) {
+            continue;
+        }
+        if (a.isImmediate() || b.isImmediate()) {
+            if (!a.isEqualTo(b)) {
+                return false;
+            }
+            continue;
+        }
+        const malValue* x = a.ptr();
+        const malValue* y = b.ptr();
+        malType xType = x->type(), yType = y->type();
+        if (malSequence::hasType(xType) || (xType == MAL_HASH)) {
+            bool sameKind = malSequence::hasType(xType)
+                ? malSequence::hasType(yType) : (yType == MAL_HASH);
+            if (!sameKind || !compareItems(x, y, pending)) {
+                return false;
+            }
+        }
+        else if (!x->isEqualTo(y)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool isHashed(const malValue* container)
 {
-    if (const malString* skey = DYNAMIC_CAST(malString, key)) {
-        return skey->print(true);
+    if (malSequence::hasType(container->type())) {
+        return static_cast<const malSequence*>(container)->isHashed();
     }
-    else if (const malKeyword* kkey = DYNAMIC_CAST(malKeyword, key)) {
-        return kkey->print(true);
+    return static_cast<const malHash*>(container)->isHashed();
+}
+
+// Adds item to the containers to hash if it's one which isn't yet.
+static void addUnhashed(const malValuePtr& item, malHashings& pending)
+{
+    if (item.isImmediate()) {
+        return;
+    }
+    const malValue* value = item.ptr();
+    malType type = value->type();
+    if ((malSequence::hasType(type) || (type == MAL_HASH)) &&
+        !isHashed(value)) {
+        pending.push_back(std::make_pair(value, false));
+    }
+}
+
+// Works out the hash of a sequence or hash-map. Those of the containers
+// within it are worked out first, innermost first, through a list rather
+// than by recursion, so that deeply nested data can't overflow the stack.
+static void hashContainer(const malValue* container)
+{
+    malHashings pending(1, std::make_pair(container, false));
+    while (!pending.empty()) {
+        const malValue* value = pending.back().first;
+        bool isSequence = malSequence::hasType(value->type());
+        if (isHashed(value)) {
+            pending.pop_back();
+        }
+        else if (pending.back().second) {
+            pending.pop_back();
+            if (isSequence) {
+                static_cast<const malSequence*>(value)->hashItems();
+            }
+            else {
+                static_cast<const malHash*>(value)->hashItems();
+            }
+        }
+        else {
+            pending.back().second = true;
+            if (isSequence) {
+                static_cast<const malSequence*>(value)
+                    ->addUnhashedItems(pending);
+            }
+            else {
+                static_cast<const malHash*>(value)->addUnhashedItems(pending);
+            }
+        }
     }
-    MAL_FAIL("%s is not a string or keyword", key->print(true).c_str());
 }
 
-static malHash::Map addToMap(malHash::Map& map,
+// Hashes are only compared once they've been worked out, as that takes a
+// walk over the whole value.
+static bool knownHashesDiffer(size_t lhs, size_t rhs)
+{
+    return (lhs != 0) && (rhs != 0) && (lhs != rhs);
+}
+
+static void addToMap(malHashTrie& map,
     malValueIter argsBegin, malValueIter argsEnd)
 {
     // This is intended to be called with pre-evaluated arguments.
     for (auto it = argsBegin; it != argsEnd; ++it) {
-        String key = makeHashKey(*it++);
-        map[key] = *it;
+        const malValuePtr& key = *it++;
+        map.set(key, *it);
     }
-
-    return map;
 }
 
-static malHash::Map createMap(malValueIter argsBegin, malValueIter argsEnd)
+static malHashTrie createMap(malValueIter argsBegin, malValueIter argsEnd)
 {
     MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 0,
             "hash-map requires an even-sized list");
 
-    malHash::Map map;
-    return addToMap(map, argsBegin, argsEnd);
+    malHashTrie map;
+    addToMap(map, argsBegin, argsEnd);
+    return map;
 }
 
 malHash::malHash(malValueIter argsBegin, malValueIter argsEnd, bool isEvaluated)
-: m_map(createMap(argsBegin, argsEnd))
+: malValue(MAL_HASH)
+, m_map(createMap(argsBegin, argsEnd))
 , m_isEvaluated(isEvaluated)
+, m_hash(0)
 {
-
+    if (m_map.mayCycle()) {
+        setMayCycle();
+    }
 }
 
-malHash::malHash(const malHash::Map& map)
-: m_map(map)
+malHash::malHash(malHashTrie map)
+: malValue(MAL_HASH)
+, m_map(std::move(map))
 , m_isEvaluated(true)
+, m_hash(0)
 {
-
+    if (m_map.mayCycle()) {
+        setMayCycle();
+    }
 }
 
 malValuePtr
@@ -169,25 +314,65 @@ malHash::assoc(malValueIter argsBegin, malValueIter argsEnd) const
     MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 0,
             "assoc requires an even-sized list");
 
-    malHash::Map map(m_map);
-    return mal::hash(addToMap(map, argsBegin, argsEnd));
+    malHashTrie map(m_map);
+    addToMap(map, argsBegin, argsEnd);
+    return mal::hash(std::move(map));
 }
 
-bool malHash::contains(malValuePtr key) const
+// A copy would lose any metadata, and be evaluated, so a map with either
+// is copied anyway.
+malValuePtr
+malHash::assocUnique(malValueIter argsBegin, malValueIter argsEnd)
 {
-    auto it = m_map.find(makeHashKey(key));
-    return it != m_map.end();
+    if (m_meta || !m_isEvaluated) {
+        return assoc(argsBegin, argsEnd);
+    }
+    MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 0,
+            "assoc requires an even-sized list");
+
+    addToMap(m_map, argsBegin, argsEnd);
+    return changedInPlace();
+}
+
+malValuePtr malHash::changedInPlace()
+{
+    m_hash = 0;
+    if (m_map.mayCycle()) {
+        setMayCycle();
+    }
+    return malValuePtr(this);
+}
+
+bool malHash::contains(const malValuePtr& key) const
+{
+    return m_map.find(key) != NULL;
 }
 
 malValuePtr
 malHash::dissoc(malValueIter argsBegin, malValueIter argsEnd) const
 {
-    malHash::Map map(m_map);
+    malHashTrie map(m_map);
     for (auto it = argsBegin; it != argsEnd; ++it) {
-        String key = makeHashKey(*it);
-        map.erase(key);
+        map.erase(*it);
     }
-    return mal::hash(map);
+    return mal::hash(std::move(map));
+}
+
+malValuePtr
+malHash::dissocUnique(malValueIter argsBegin, malValueIter argsEnd)
+{
+    if (m_meta || !m_isEvaluated) {
+        return dissoc(argsBegin, argsEnd);
+    }
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        m_map.erase(*it);
+    }
+    return changedInPlace();
+}
+
+malValuePtr malHash::transient() const
+{
+    return malValuePtr(new malTransient(m_map));
 }
 
 malValuePtr malHash::eval(malEnvPtr env)
@@ -196,113 +381,165 @@ malValuePtr malHash::eval(malEnvPtr env)
         return malValuePtr(this);
     }
 
-    malHash::Map map;
-    for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
-        map[it->first] = EVAL(it->second, env);
-    }
-    return mal::hash(map);
+    malHashTrie map;
+    m_map.forEach([&](const malHashEntry& entry) {
+        map.set(entry.key, EVAL(entry.value, env));
+    });
+    return mal::hash(std::move(map));
 }
 
-malValuePtr malHash::get(malValuePtr key) const
+malValuePtr malHash::get(const malValuePtr& key) const
 {
-    auto it = m_map.find(makeHashKey(key));
-    return it == m_map.end() ? mal::nilValue() : it->second;
+    const malValuePtr* value = m_map.find(key);
+    return value ? *value : mal::nilValue();
 }
 
 malValuePtr malHash::keys() const
 {
     malValueVec* keys = new malValueVec();
-    keys->reserve(m_map.size());
-    for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
-        if (it->first[0] == '"') {
-            keys->push_back(mal::string(unescape(it->first)));
-        }
-        else {
-            keys->push_back(mal::keyword(it->first));
-        }
-    }
+    keys->reserve(m_map.count());
+    m_map.forEach([keys](const malHashEntry& entry) {
+        keys->push_back(entry.key);
+    });
     return mal::list(keys);
 }
 
 malValuePtr malHash::values() const
 {
     malValueVec* keys = new malValueVec();
-    keys->reserve(m_map.size());
-    for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
-        keys->push_back(it->second);
-    }
+    keys->reserve(m_map.count());
+    m_map.forEach([keys](const malHashEntry& entry) {
+        keys->push_back(entry.value);
+    });
     return mal::list(keys);
 }
 
 String malHash::print(bool readably) const
 {
-    String s = "{";
+    String s;
+    m_map.forEach([&](const malHashEntry& entry) {
+        s += s.empty() ? "{" : " ";
+        s += entry.key->print(true) + " " + entry.value->print(readably);
+    });
+    return s.empty() ? "{}" : s + "}";
+}
 
-    auto it = m_map.begin(), end = m_map.end();
-    if (it != end) {
-        s += it->first + " " + it->second->print(readably);
-        ++it;
-    }
-    for ( ; it != end; ++it) {
-        s += " " + it->first + " " + it->second->print(readably);
+// The entries are in no particular order, so their hashes are combined in a
+// way which doesn't depend on it.
+size_t malHash::hash() const
+{
+    if (m_hash == 0) {
+        hashContainer(this);
     }
+    return m_hash;
+}
 
-    return s + "}";
+void malHash::addUnhashedItems(malHashings& pending) const
+{
+    m_map.forEach([&pending](const malHashEntry& entry) {
+        addUnhashed(entry.value, pending);
+    });
+}
+
+// The values are hashed by now, as are the keys, when they're added.
+void malHash::hashItems() const
+{
+    size_t hash = MAL_HASH;
+    m_map.forEach([&hash](const malHashEntry& entry) {
+        hash += mixHash(entry.hash, entry.value.hash());
+    });
+    m_hash = hash;
+}
+
+void malHash::traceRefs(malTracer& tracer) const
+{
+    malValue::traceRefs(tracer);
+    m_map.traceRefs(tracer);
 }
 
 bool malHash::doIsEqualTo(const malValue* rhs) const
 {
-    const malHash::Map& r_map = static_cast<const malHash*>(rhs)->m_map;
-    if (m_map.size() != r_map.size()) {
+    return containersEqual(this, rhs);
+}
+
+bool malHash::compareItems(const malHash* rhs, malComparisons& pending) const
+{
+    const malHashTrie& r_map = rhs->m_map;
+    if ((m_map.count() != r_map.count()) ||
+        knownHashesDiffer(m_hash, rhs->m_hash)) {
         return false;
     }
 
-    for (auto it0 = m_map.begin(), end0 = m_map.end(), it1 = r_map.begin();
-         it0 != end0; ++it0, ++it1) {
-
-        if (it0->first != it1->first) {
-            return false;
+    bool isEqual = true;
+    m_map.forEach([&](const malHashEntry& entry) {
+        const malValuePtr* value = isEqual ? r_map.find(entry.key) : NULL;
+        if (value) {
+            pending.push_back(std::make_pair(&entry.value, value));
         }
-        if (!it0->second->isEqualTo(it1->second.ptr())) {
-            return false;
-        }
-    }
-    return true;
+        isEqual = (value != NULL);
+    });
+    return isEqual;
+}
+
+static SymbolIdVec internBindings(const StringVec& bindings)
+{
+    SymbolIdVec ids(bindings.size());
+    std::transform(bindings.begin(), bindings.end(), ids.begin(),
+                   internSymbol);
+    return ids;
 }
 
 malLambda::malLambda(const StringVec& bindings,
                      malValuePtr body, malEnvPtr env)
-: m_bindings(bindings)
-, m_body(body)
-, m_env(env)
+: malApplicable(MAL_LAMBDA)
+, m_bindings(internBindings(bindings))
+, m_body(std::move(body))
+, m_env(std::move(env))
 , m_isMacro(false)
 {
+    setMayCycle();
+}
 
+malLambda::malLambda(const SymbolIdVec& bindings,
+                     malValuePtr body, malEnvPtr env, malCodePtr code)
+: malApplicable(MAL_LAMBDA)
+, m_bindings(bindings)
+, m_body(std::move(body))
+, m_code(std::move(code))
+, m_env(std::move(env))
+, m_isMacro(false)
+{
+    setMayCycle();
 }
 
 malLambda::malLambda(const malLambda& that, malValuePtr meta)
-: malApplicable(meta)
+: malApplicable(MAL_LAMBDA, meta)
 , m_bindings(that.m_bindings)
 , m_body(that.m_body)
+, m_code(that.m_code)
 , m_env(that.m_env)
 , m_isMacro(that.m_isMacro)
 {
-
+    setMayCycle();
 }
 
 malLambda::malLambda(const malLambda& that, bool isMacro)
-: malApplicable(that.m_meta)
+: malApplicable(MAL_LAMBDA, that.m_meta)
 , m_bindings(that.m_bindings)
 , m_body(that.m_body)
+, m_code(that.m_code)
 , m_env(that.m_env)
 , m_isMacro(isMacro)
 {
-
+    setMayCycle();
 }
 
 malValuePtr malLambda::apply(malValueIter argsBegin,
                              malValueIter argsEnd) const
 {
+    if (m_code) {
+        return m_code->apply(this, argsBegin, argsEnd);
+    }
     return EVAL(m_body, makeEnv(argsBegin, argsEnd));
 }
 
@@ -311,6 +548,14 @@ malValuePtr malLambda::doWithMeta(malValuePtr meta) const
     return new malLambda(*this, meta);
 }
 
+void malLambda::traceRefs(malTracer& tracer) const
+{
+    malValue::traceRefs(tracer);
+    tracer(m_body);
+    tracer(m_code);
+    tracer(m_env);
+}
+
 malEnvPtr malLambda::makeEnv(malValueIter argsBegin, malValueIter argsEnd) const
 {
     return malEnvPtr(new malEnv(m_env, m_bindings, argsBegin, argsEnd));
@@ -329,6 +574,20 @@ malValuePtr malList::conj(malValueIter argsBegin,
     return mal::list(items);
 }
 
+// A list's array can't grow, but its items can move rather than be copied.
+malValuePtr malList::conjUnique(malValueIter argsBegin,
+                                malValueIter argsEnd)
+{
+    int oldItemCount = count();
+    int newItemCount = std::distance(argsBegin, argsEnd);
+
+    malValueVec* items = new malValueVec(oldItemCount + newItemCount);
+    std::reverse_copy(argsBegin, argsEnd, items->begin());
+    moveItemsTo(items->data() + newItemCount);
+
+    return mal::list(items);
+}
+
 malValuePtr malList::eval(malEnvPtr env)
 {
     // Note, this isn't actually called since the TCO updates, but
@@ -338,9 +597,9 @@ malValuePtr malList::eval(malEnvPtr env)
     }
 
     std::unique_ptr<malValueVec> items(evalItems(env));
-    auto it = items->begin();
+    malValueIter it = items->data();
     malValuePtr op = *it;
-    return APPLY(op, ++it, items->end());
+    return APPLY(op, it + 1, it + items->size());
 }
 
 String malList::print(bool readably) const
@@ -354,25 +613,33 @@ malValuePtr malValue::eval(malEnvPtr env)
     return malValuePtr(this);
 }
 
+malValuePtr malInteger::eval(malEnvPtr env)
+{
+    // Boxed integers go back to being immediate.
+    return mal::integer(m_value);
+}
+
 bool malValue::isEqualTo(const malValue* rhs) const
 {
+    if (this == rhs) {
+        return true;
+    }
+
     // Special-case. Vectors and Lists can be compared.
-    bool matchingTypes = (typeid(*this) == typeid(*rhs)) ||
-        (dynamic_cast<const malSequence*>(this) &&
-         dynamic_cast<const malSequence*>(rhs));
+    bool matchingTypes = (m_type == rhs->m_type) ||
+        (malSequence::hasType(m_type) && malSequence::hasType(rhs->m_type));
 
     return matchingTypes && doIsEqualTo(rhs);
 }
 
-bool malValue::isTrue() const
+size_t malValue::hash() const
 {
-    return (this != mal::falseValue().ptr())
-        && (this != mal::nilValue().ptr());
+    return reinterpret_cast<uintptr_t>(this) >> 4;
 }
 
 malValuePtr malValue::meta() const
 {
-    return m_meta.ptr() == NULL ? mal::nilValue() : m_meta;
+    return !m_meta ? mal::nilValue() : m_meta;
 }
 
 malValuePtr malValue::withMeta(malValuePtr meta) const
@@ -380,44 +647,152 @@ malValuePtr malValue::withMeta(malValuePtr meta) const
     return doWithMeta(meta);
 }
 
-malSequence::malSequence(malValueVec* items)
-: m_items(items)
+void malValue::traceRefs(malTracer& tracer) const
+{
+    tracer(m_meta);
+}
+
+void malAtom::traceRefs(malTracer& tracer) const
+{
+    malValue::traceRefs(tracer);
+    tracer(m_value);
+}
+
+// A container can be part of a cycle if anything in it can.
+static bool anyMayCycle(malValueIter begin, malValueIter end)
 {
+    for (auto it = begin; it != end; ++it) {
+        if (it->mayCycle()) {
+            return true;
+        }
+    }
+    return false;
+}
 
+void* malSequence::operator new(size_t size, int count)
+{
+    size += count * sizeof(malValuePtr);
+#if MAL_USE_POOL
+    return malPool::allocateVariable(size);
+#else
+    return ::operator new(size);
+#endif
 }
 
-malSequence::malSequence(malValueIter begin, malValueIter end)
-: m_items(new malValueVec(begin, end))
+void malSequence::operator delete(void* block, int count)
 {
+    malSequence::operator delete(block);
+}
+
+void malSequence::operator delete(void* block)
+{
+#if MAL_USE_POOL
+    malPool::releaseVariable(block);
+#else
+    ::operator delete(block);
+#endif
+}
+
+malSequence::malSequence(malType type, malValuePtr* storage,
+                         malValueVec* items)
+: malValue(type)
+, m_items(storage)
+, m_count(items->size())
+, m_hash(0)
+{
+    std::uninitialized_copy(std::make_move_iterator(items->begin()),
+                            std::make_move_iterator(items->end()), m_items);
+    delete items;
+    if (anyMayCycle(m_items, m_items + m_count)) {
+        setMayCycle();
+    }
+}
+
+malSequence::malSequence(malType type, malValuePtr* storage,
+                         malValueIter begin, malValueIter end)
+: malValue(type)
+, m_items(storage)
+, m_count(end - begin)
+, m_hash(0)
+{
+    std::uninitialized_copy(begin, end, m_items);
+    if (anyMayCycle(m_items, m_items + m_count)) {
+        setMayCycle();
+    }
+}
+
+malSequence::malSequence(const malSequence& that, malValuePtr* storage,
+                         malValuePtr meta)
+: malValue(that.type(), meta)
+, m_items(storage)
+, m_count(that.m_count)
+, m_hash(0)
+{
+    std::uninitialized_copy(that.begin(), that.end(), m_items);
+    if (that.mayCycle()) {
+        setMayCycle();
+    }
+}
 
+malSequence::malSequence(malType type, const malSequence* root,
+                         int from, int count)
+: malValue(type)
+, m_items(root->m_items + from)
+, m_count(count)
+, m_root(const_cast<malSequence*>(root))
+, m_hash(0)
+{
+    if (root->mayCycle()) {
+        setMayCycle();
+    }
 }
 
-malSequence::malSequence(const malSequence& that, malValuePtr meta)
-: malValue(meta)
-, m_items(new malValueVec(*(that.m_items)))
+malSequence::malSequence(malType type, int count, malValuePtr meta)
+: malValue(type, std::move(meta))
+, m_items(NULL)
+, m_count(count)
+, m_hash(0)
 {
 
 }
 
 malSequence::~malSequence()
 {
-    delete m_items;
+    // Slices, and sequences that made their array on demand, have a root
+    // which owns their items.
+    if (m_root || !m_items) {
+        return;
+    }
+    for (int i = 0; i < m_count; i++) {
+        m_items[i].~malValuePtr();
+    }
 }
 
-bool malSequence::doIsEqualTo(const malValue* rhs) const
+void malSequence::traceRefs(malTracer& tracer) const
 {
-    const malSequence* rhsSeq = static_cast<const malSequence*>(rhs);
-    if (count() != rhsSeq->count()) {
-        return false;
+    malValue::traceRefs(tracer);
+    if (m_root) {
+        tracer(m_root);
+    }
+    else if (m_items) {
+        tracer(m_items, m_items + m_count);
     }
+    tracer(m_quasiquoted);
+}
 
-    for (malValueIter it0 = m_items->begin(),
-                      it1 = rhsSeq->begin(),
-                      end = m_items->end(); it0 != end; ++it0, ++it1) {
+bool malSequence::doIsEqualTo(const malValue* rhs) const
+{
+    return containersEqual(this, rhs);
+}
 
-        if (! (*it0)->isEqualTo((*it1).ptr())) {
-            return false;
-        }
+bool malSequence::compareItems(const malSequence* rhs,
+                               malComparisons& pending) const
+{
+    if ((m_count != rhs->m_count) || knownHashesDiffer(m_hash, rhs->m_hash)) {
+        return false;
+    }
+    for (int i = 0; i < m_count; i++) {
+        pending.push_back(std::make_pair(&item(i), &rhs->item(i)));
     }
     return true;
 }
@@ -426,12 +801,38 @@ malValueVec* malSequence::evalItems(malEnvPtr env) const
 {
     malValueVec* items = new malValueVec;;
     items->reserve(count());
-    for (auto it = m_items->begin(), end = m_items->end(); it != end; ++it) {
+    for (auto it = begin(), end = this->end(); it != end; ++it) {
         items->push_back(EVAL(*it, env));
     }
     return items;
 }
 
+// Lists and vectors with the same items are equal, so hash the same.
+size_t malSequence::hash() const
+{
+    if (m_hash == 0) {
+        hashContainer(this);
+    }
+    return m_hash;
+}
+
+void malSequence::addUnhashedItems(malHashings& pending) const
+{
+    for (int i = 0; i < m_count; i++) {
+        addUnhashed(item(i), pending);
+    }
+}
+
+// The items are hashed by now.
+void malSequence::hashItems() const
+{
+    size_t hash = MAL_LIST;
+    for (int i = 0; i < m_count; i++) {
+        hash = mixHash(hash, item(i).hash());
+    }
+    m_hash = hash;
+}
+
 malValuePtr malSequence::first() const
 {
     return count() == 0 ? mal::nilValue() : item(0);
@@ -440,8 +841,8 @@ malValuePtr malSequence::first() const
 String malSequence::print(bool readably) const
 {
     String str;
-    auto end = m_items->cend();
-    auto it = m_items->cbegin();
+    auto end = this->end();
+    auto it = begin();
     if (it != end) {
         str += (*it)->print(readably);
         ++it;
@@ -455,8 +856,63 @@ String malSequence::print(bool readably) const
 
 malValuePtr malSequence::rest() const
 {
-    malValueIter start = (count() > 0) ? begin() + 1 : end();
-    return mal::list(start, end());
+    return slice(1);
+}
+
+const malValuePtr& malSequence::lookup(int index) const
+{
+    return begin()[index];
+}
+
+malValueIter malSequence::flatItems() const
+{
+    return m_items;
+}
+
+// Takes the items of a list as this sequence's own.
+void malSequence::setFlatItems(malValuePtr list) const
+{
+    m_items = STATIC_CAST(malSequence, list)->m_items;
+    m_root = std::move(list);
+}
+
+void malSequence::moveItemsTo(malValueIter dest)
+{
+    if (!ownsItems()) {
+        std::copy(begin(), end(), dest);
+        return;
+    }
+    std::move(begin(), end(), dest);
+    itemsChanged(0);
+}
+
+void malSequence::itemsChanged(int count)
+{
+    if (m_root) {
+        m_root = malValuePtr();
+        m_items = NULL;
+    }
+    m_count = count;
+    m_hash = 0;
+    m_quasiquoted = malValuePtr();
+}
+
+malValuePtr malSequence::slice(int from) const
+{
+    malValueIter items = begin();
+    from = std::min(from, m_count);
+    int count = m_count - from;
+    const malSequence* root = m_root ? STATIC_CAST(malSequence, m_root)
+                                     : this;
+
+    // A slice keeps all of its root's items alive, so once most of them
+    // would be unreachable, copy the rest instead. Repeated rests then
+    // copy lists of halving lengths, which is still linear overall.
+    if (count == 0 || 2 * count < root->m_count) {
+        return mal::list(begin() + from, end());
+    }
+    return malValuePtr(new (0) malList(root, items + from - root->m_items,
+                                       count));
 }
 
 String malString::escapedValue() const
@@ -471,22 +927,172 @@ String malString::print(bool readably) const
 
 malValuePtr malSymbol::eval(malEnvPtr env)
 {
-    return env->get(value());
+    return env->get(m_id);
+}
+
+// Sets each index to its value, where the index just past the end adds
+// the value there.
+static void assocItems(malVectorTrie& items,
+                       malValueIter argsBegin, malValueIter argsEnd)
+{
+    MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 0,
+            "assoc requires an even-sized list");
+
+    for (auto it = argsBegin; it != argsEnd; it += 2) {
+        int64_t index = INTEGER_CAST(*it);
+        MAL_CHECK(index >= 0 && index <= items.count(), "Index out of range");
+        if (index == items.count()) {
+            items.push(*(it + 1));
+        }
+        else {
+            items.set(index, *(it + 1));
+        }
+    }
+}
+
+malValuePtr malVector::assoc(malValueIter argsBegin,
+                             malValueIter argsEnd) const
+{
+    malVectorTrie items = trie();
+    assocItems(items, argsBegin, argsEnd);
+    return malValuePtr(new (0) malVector(std::move(items), malValuePtr()));
 }
 
 malValuePtr malVector::conj(malValueIter argsBegin,
                             malValueIter argsEnd) const
 {
-    int oldItemCount = std::distance(begin(), end());
+    int oldItemCount = count();
     int newItemCount = std::distance(argsBegin, argsEnd);
 
+    if (!isTrie() && oldItemCount + newItemCount <= FLAT_LIMIT) {
+        malValueVec* items = new malValueVec(oldItemCount + newItemCount);
+        std::copy(begin(), end(), items->begin());
+        std::copy(argsBegin, argsEnd, items->begin() + oldItemCount);
+        return mal::vector(items);
+    }
+
+    malVectorTrie items = trie();
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        items.push(*it);
+    }
+    return malValuePtr(new (0) malVector(std::move(items), malValuePtr()));
+}
+
+// A trie takes new items in place, as its nodes which nothing else shares
+// can be changed, while a flat vector's items can move to the result. A
+// copy would lose any metadata, so a vector with some is copied anyway.
+malValuePtr malVector::conjUnique(malValueIter argsBegin,
+                                  malValueIter argsEnd)
+{
+    if (m_meta) {
+        return conj(argsBegin, argsEnd);
+    }
+    if (isTrie()) {
+        for (auto it = argsBegin; it != argsEnd; ++it) {
+            m_trie.push(*it);
+        }
+        return changedInPlace();
+    }
+
+    int oldItemCount = count();
+    int newItemCount = std::distance(argsBegin, argsEnd);
+    if (oldItemCount + newItemCount > FLAT_LIMIT) {
+        return conj(argsBegin, argsEnd);
+    }
     malValueVec* items = new malValueVec(oldItemCount + newItemCount);
-    std::copy(begin(), end(), items->begin());
+    moveItemsTo(items->data());
     std::copy(argsBegin, argsEnd, items->begin() + oldItemCount);
-
     return mal::vector(items);
 }
 
+malValuePtr malVector::assocUnique(malValueIter argsBegin,
+                                   malValueIter argsEnd)
+{
+    if (m_meta) {
+        return assoc(argsBegin, argsEnd);
+    }
+    MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 0,
+            "assoc requires an even-sized list");
+
+    // Check every index first, so that a bad one leaves this unchanged.
+    int newCount = count();
+    for (auto it = argsBegin; it != argsEnd; it += 2) {
+        int64_t index = INTEGER_CAST(*it);
+        MAL_CHECK(index >= 0 && index <= newCount, "Index out of range");
+        if (index == newCount) {
+            newCount++;
+        }
+    }
+
+    if (isTrie()) {
+        assocItems(m_trie, argsBegin, argsEnd);
+        return changedInPlace();
+    }
+    if (newCount != count()) {
+        return assoc(argsBegin, argsEnd);
+    }
+    malValueIter items = begin();
+    for (auto it = argsBegin; it != argsEnd; it += 2) {
+        items[INTEGER_CAST(*it)] = *(it + 1);
+    }
+    return changedInPlace();
+}
+
+malValuePtr malVector::changedInPlace()
+{
+    if (isTrie()) {
+        itemsChanged(m_trie.count());
+        if (m_trie.mayCycle()) {
+            setMayCycle();
+        }
+    }
+    else {
+        itemsChanged(count());
+        if (anyMayCycle(begin(), end())) {
+            setMayCycle();
+        }
+    }
+    return malValuePtr(this);
+}
+
+malValuePtr malVector::doWithMeta(malValuePtr meta) const
+{
+    if (isTrie()) {
+        return new (0) malVector(m_trie, meta);
+    }
+    return new (count()) malVector(*this, meta);
+}
+
+malValuePtr malVector::transient() const
+{
+    return malValuePtr(new malTransient(trie()));
+}
+
+void malVector::traceRefs(malTracer& tracer) const
+{
+    malSequence::traceRefs(tracer);
+    m_trie.traceRefs(tracer);
+}
+
+const malValuePtr& malVector::lookup(int index) const
+{
+    return m_trie.item(index);
+}
+
+malValueIter malVector::flatItems() const
+{
+    malValueVec* items = new malValueVec;
+    m_trie.appendTo(*items);
+    setFlatItems(mal::list(items));
+    return begin();
+}
+
+// A trie of the items, to change.
+malVectorTrie malVector::trie() const
+{
+    return isTrie() ? m_trie : malVectorTrie(begin(), end());
+}
+
 malValuePtr malVector::eval(malEnvPtr env)
 {
     return mal::vector(evalItems(env));
@@ -496,3 +1102,122 @@ String malVector::print(bool readably) const
 {
     return '[' + malSequence::print(readably) + ']';
 }
+
+malTransient::malTransient(malVectorTrie items)
+: malValue(MAL_TRANSIENT)
+, m_isVector(true)
+, m_isEditable(true)
+, m_items(std::move(items))
+{
+    setMayCycle();
+}
+
+malTransient::malTransient(malHashTrie map)
+: malValue(MAL_TRANSIENT)
+, m_isVector(false)
+, m_isEditable(true)
+, m_map(std::move(map))
+{
+    setMayCycle();
+}
+
+void malTransient::checkEditable(const char* name) const
+{
+    MAL_CHECK(m_isEditable, "%s: transient used after persistent!", name);
+}
+
+malValuePtr malTransient::conj(malValueIter argsBegin, malValueIter argsEnd)
+{
+    checkEditable("conj!");
+    MAL_CHECK(m_isVector, "conj! needs a transient vector");
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        m_items.push(*it);
+    }
+    return malValuePtr(this);
+}
+
+malValuePtr malTransient::assoc(malValueIter argsBegin, malValueIter argsEnd)
+{
+    checkEditable("assoc!");
+    if (m_isVector) {
+        assocItems(m_items, argsBegin, argsEnd);
+    }
+    else {
+        MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 0,
+                "assoc! requires an even-sized list");
+        addToMap(m_map, argsBegin, argsEnd);
+    }
+    return malValuePtr(this);
+}
+
+malValuePtr malTransient::dissoc(malValueIter argsBegin, malValueIter argsEnd)
+{
+    checkEditable("dissoc!");
+    MAL_CHECK(!m_isVector, "dissoc! needs a transient hash-map");
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        m_map.erase(*it);
+    }
+    return malValuePtr(this);
+}
+
+malValuePtr malTransient::persistent()
+{
+    checkEditable("persistent!");
+    m_isEditable = false;
+    if (m_isVector) {
+        malVectorTrie items(std::move(m_items));
+        m_items = malVectorTrie();
+        return malValuePtr(new (0) malVector(std::move(items),
+                                             malValuePtr()));
+    }
+    malHashTrie map(std::move(m_map));
+    m_map = malHashTrie();
+    return mal::hash(std::move(map));
+}
+
+int malTransient::count() const
+{
+    checkEditable("count");
+    return m_isVector ? m_items.count() : m_map.count();
+}
+
+malValuePtr malTransient::nth(int64_t index) const
+{
+    checkEditable("nth");
+    MAL_CHECK(m_isVector, "nth needs a transient vector");
+    MAL_CHECK(index >= 0 && index < m_items.count(), "Index out of range");
+    return m_items.item(index);
+}
+
+malValuePtr malTransient::get(const malValuePtr& key) const
+{
+    checkEditable("get");
+    MAL_CHECK(!m_isVector, "get needs a transient hash-map");
+    const malValuePtr* value = m_map.find(key);
+    return value ? *value : mal::nilValue();
+}
+
+bool malTransient::contains(const malValuePtr& key) const
+{
+    checkEditable("contains?");
+    MAL_CHECK(!m_isVector, "contains? needs a transient hash-map");
+    return m_map.find(key) != NULL;
+}
+
+malValuePtr malTransient::doWithMeta(malValuePtr meta) const
+{
+    MAL_FAIL("transients can't have metadata");
+}
+
+void malTransient::traceRefs(malTracer& tracer) const
+{
+    malValue::traceRefs(tracer);
+    m_items.traceRefs(tracer);
+    m_map.traceRefs(tracer);
+}
+
+void malTransient::dropRefs()
+{
+    m_items = malVectorTrie();
+    m_map = malHashTrie();
+}
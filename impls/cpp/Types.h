@@ -2,52 +2,107 @@
 #define INCLUDE_TYPES_H
 
 #include "MAL.h"
+#include "HashTrie.h"
+#include "SymbolTable.h"
+#include "VectorTrie.h"
 
 #include <exception>
+#include <functional>
 #include <map>
 
 class malEmptyInputException : public std::exception { };
 
+// Pairs of items still to compare, so that comparing nested data works
+// through a list rather than recursing.
+typedef std::vector<std::pair<const malValuePtr*, const malValuePtr*> >
+    malComparisons;
+
+// Containers still to hash, and whether their items have been added, so
+// that hashing nested data works through a list rather than recursing.
+typedef std::vector<std::pair<const malValue*, bool> > malHashings;
+
 class malValue : public RefCounted {
 public:
-    malValue() {
+    POOL_ALLOCATED
+
+    malValue(malType type) : m_type(type) {
         TRACE_OBJECT("Creating malValue %p\n", this);
     }
-    malValue(malValuePtr meta) : m_meta(meta) {
+    malValue(malType type, malValuePtr meta)
+        : m_meta(std::move(meta)), m_type(type) {
         TRACE_OBJECT("Creating malValue %p\n", this);
+        if (m_meta.mayCycle()) {
+            setMayCycle();
+        }
     }
     virtual ~malValue() {
         TRACE_OBJECT("Destroying malValue %p\n", this);
     }
 
+    malType type() const { return m_type; }
+
     malValuePtr withMeta(malValuePtr meta) const;
     virtual malValuePtr doWithMeta(malValuePtr meta) const = 0;
     malValuePtr meta() const;
 
-    bool isTrue() const;
-
     bool isEqualTo(const malValue* rhs) const;
 
+    // Values which are isEqualTo each other have the same hash. Those
+    // which are only equal to themselves hash their address.
+    virtual size_t hash() const;
+
     virtual malValuePtr eval(malEnvPtr env);
 
     virtual String print(bool readably) const = 0;
 
+    virtual void traceRefs(malTracer& tracer) const;
+
 protected:
     virtual bool doIsEqualTo(const malValue* rhs) const = 0;
 
     malValuePtr m_meta;
+
+private:
+    const malType m_type;
 };
 
+// Folds the hash of a part into the hash of the whole.
+inline size_t mixHash(size_t seed, size_t hash) {
+    return seed ^ (hash + size_t(0x9e3779b97f4a7c15ULL)
+                        + (seed << 6) + (seed >> 2));
+}
+
+// Each class says which tags belong to it, with TYPE_TAG for the concrete
+// classes.
+#define TYPE_TAG(Tag) \
+    static bool hasType(malType type) { return type == Tag; }
+
+template<class T>
+bool is_a(const malValuePtr& obj) {
+    return obj && T::hasType(obj.type());
+}
+
 template<class T>
-T* value_cast(malValuePtr obj, const char* typeName) {
-    T* dest = dynamic_cast<T*>(obj.ptr());
+T* tag_cast(const malValuePtr& obj) {
+    return is_a<T>(obj) ? static_cast<T*>(obj.ptr()) : NULL;
+}
+
+template<class T>
+T* value_cast(const malValuePtr& obj, const char* typeName) {
+    T* dest = tag_cast<T>(obj);
     MAL_CHECK(dest != NULL, "%s is not a %s",
               obj->print(true).c_str(), typeName);
     return dest;
 }
 
+// Integers are mostly immediate, so they're read through the reference
+// rather than cast to a malInteger.
+int64_t integer_cast(const malValuePtr& obj);
+
 #define VALUE_CAST(Type, Value)    value_cast<Type>(Value, #Type)
-#define DYNAMIC_CAST(Type, Value)  (dynamic_cast<Type*>((Value).ptr()))
+#define DYNAMIC_CAST(Type, Value)  (tag_cast<Type>(Value))
+#define INTEGER_CAST(Value)        integer_cast(Value)
+#define IS_A(Type, Value)          is_a<Type>(Value)
 #define STATIC_CAST(Type, Value)   (static_cast<Type*>((Value).ptr()))
 
 #define WITH_META(Type) \
@@ -57,9 +112,17 @@ T* value_cast(malValuePtr obj, const char* typeName) {
 
 class malConstant : public malValue {
 public:
-    malConstant(String name) : m_name(name) { }
+    malConstant(String name, malValuePtr::Constant which)
+        : malValue(MAL_CONSTANT), m_name(name), m_which(which) { }
     malConstant(const malConstant& that, malValuePtr meta)
-        : malValue(meta), m_name(that.m_name) { }
+        : malValue(MAL_CONSTANT, meta)
+        , m_name(that.m_name), m_which(that.m_which) { }
+
+    TYPE_TAG(MAL_CONSTANT);
+
+    virtual malValuePtr eval(malEnvPtr env) {
+        return malValuePtr::constant(m_which);
+    }
 
     virtual String print(bool readably) const { return m_name; }
 
@@ -71,13 +134,16 @@ public:
 
 private:
     const String m_name;
+    const malValuePtr::Constant m_which;
 };
 
 class malInteger : public malValue {
 public:
-    malInteger(int64_t value) : m_value(value) { }
+    malInteger(int64_t value) : malValue(MAL_INTEGER), m_value(value) { }
     malInteger(const malInteger& that, malValuePtr meta)
-        : malValue(meta), m_value(that.m_value) { }
+        : malValue(MAL_INTEGER, meta), m_value(that.m_value) { }
+
+    TYPE_TAG(MAL_INTEGER);
 
     virtual String print(bool readably) const {
         return std::to_string(m_value);
@@ -85,10 +151,16 @@ public:
 
     int64_t value() const { return m_value; }
 
+    virtual malValuePtr eval(malEnvPtr env);
+
     virtual bool doIsEqualTo(const malValue* rhs) const {
         return m_value == static_cast<const malInteger*>(rhs)->m_value;
     }
 
+    // Shared with immediate integers, which are equal to boxed ones.
+    static size_t hashOf(int64_t value) { return size_t(value); }
+    virtual size_t hash() const { return hashOf(m_value); }
+
     WITH_META(malInteger);
 
 private:
@@ -97,26 +169,42 @@ private:
 
 class malStringBase : public malValue {
 public:
-    malStringBase(const String& token)
-        : m_value(token) { }
+    malStringBase(malType type, const String& token)
+        : malValue(type), m_value(token), m_hash(0) { }
     malStringBase(const malStringBase& that, malValuePtr meta)
-        : malValue(meta), m_value(that.value()) { }
+        : malValue(that.type(), meta), m_value(that.value())
+        , m_hash(that.m_hash) { }
+
+    static bool hasType(malType type) {
+        return type == MAL_STRING || type == MAL_KEYWORD;
+    }
 
     virtual String print(bool readably) const { return m_value; }
 
-    String value() const { return m_value; }
+    const String& value() const { return m_value; }
+
+    // Worked out on first use, as strings are often hash-map keys.
+    virtual size_t hash() const {
+        if (m_hash == 0) {
+            m_hash = std::hash<String>()(m_value) * 31 + type();
+        }
+        return m_hash;
+    }
 
 private:
     const String m_value;
+    mutable size_t m_hash;
 };
 
 class malString : public malStringBase {
 public:
     malString(const String& token)
-        : malStringBase(token) { }
+        : malStringBase(MAL_STRING, token) { }
     malString(const malString& that, malValuePtr meta)
         : malStringBase(that, meta) { }
 
+    TYPE_TAG(MAL_STRING);
+
     virtual String print(bool readably) const;
 
     String escapedValue() const;
@@ -131,100 +219,263 @@ public:
 class malKeyword : public malStringBase {
 public:
     malKeyword(const String& token)
-        : malStringBase(token) { }
+        : malStringBase(MAL_KEYWORD, token) { }
     malKeyword(const malKeyword& that, malValuePtr meta)
         : malStringBase(that, meta) { }
 
+    TYPE_TAG(MAL_KEYWORD);
+
+    // Keywords are interned by mal::keyword, and only copies made to carry
+    // metadata share a name with another keyword.
     virtual bool doIsEqualTo(const malValue* rhs) const {
-        return value() == static_cast<const malKeyword*>(rhs)->value();
+        const malKeyword* keyword = static_cast<const malKeyword*>(rhs);
+        if (!m_meta && !keyword->m_meta) {
+            return this == keyword;
+        }
+        return value() == keyword->value();
     }
 
     WITH_META(malKeyword);
 };
 
-class malSymbol : public malStringBase {
+class malSymbol : public malValue {
 public:
-    malSymbol(const String& token)
-        : malStringBase(token) { }
+    malSymbol(SymbolId id)
+        : malValue(MAL_SYMBOL), m_id(id) { }
     malSymbol(const malSymbol& that, malValuePtr meta)
-        : malStringBase(that, meta) { }
+        : malValue(MAL_SYMBOL, meta), m_id(that.m_id) { }
+
+    TYPE_TAG(MAL_SYMBOL);
 
     virtual malValuePtr eval(malEnvPtr env);
 
+    virtual String print(bool readably) const { return value(); }
+
+    SymbolId id() const { return m_id; }
+    const String& value() const { return symbolName(m_id); }
+
     virtual bool doIsEqualTo(const malValue* rhs) const {
-        return value() == static_cast<const malSymbol*>(rhs)->value();
+        return m_id == static_cast<const malSymbol*>(rhs)->m_id;
     }
 
+    virtual size_t hash() const { return mixHash(MAL_SYMBOL, m_id); }
+
     WITH_META(malSymbol);
+
+private:
+    const SymbolId m_id;
 };
 
+// Sequences are immutable, so their items are stored in an array allocated
+// along with the object, rather than in a vector of their own. They're made
+// with new (count) malList(...), and so on. Vectors built up by conj and
+// assoc keep their items in a trie instead, and only make the array if
+// something iterates over them.
+//
+// The only exception is a sequence that nothing else refers to, which no
+// one can see change. The ...Unique functions are for those: they give the
+// items to the result rather than copying them, or change the sequence in
+// place and return it.
 class malSequence : public malValue {
 public:
-    malSequence(malValueVec* items);
-    malSequence(malValueIter begin, malValueIter end);
-    malSequence(const malSequence& that, malValuePtr meta);
+    static void* operator new(size_t size, int count);
+    static void operator delete(void* block, int count);
+    static void operator delete(void* block);
+
     virtual ~malSequence();
 
+    static bool hasType(malType type) {
+        return type == MAL_LIST || type == MAL_VECTOR;
+    }
+
     virtual String print(bool readably) const;
 
     malValueVec* evalItems(malEnvPtr env) const;
-    int count() const { return m_items->size(); }
-    bool isEmpty() const { return m_items->empty(); }
-    malValuePtr item(int index) const { return (*m_items)[index]; }
+    int count() const { return m_count; }
+    bool isEmpty() const { return m_count == 0; }
+    const malValuePtr& item(int index) const {
+        return m_items ? m_items[index] : lookup(index);
+    }
 
-    malValueIter begin() const { return m_items->begin(); }
-    malValueIter end()   const { return m_items->end(); }
+    malValueIter begin() const { return m_items ? m_items : flatItems(); }
+    malValueIter end()   const { return begin() + m_count; }
 
     virtual bool doIsEqualTo(const malValue* rhs) const;
+    bool compareItems(const malSequence* rhs, malComparisons& pending) const;
+    virtual size_t hash() const;
+    bool isHashed() const { return m_hash != 0; }
+    void addUnhashedItems(malHashings& pending) const;
+    void hashItems() const;
 
     virtual malValuePtr conj(malValueIter argsBegin,
                               malValueIter argsEnd) const = 0;
+    virtual malValuePtr conjUnique(malValueIter argsBegin,
+                                   malValueIter argsEnd) = 0;
+
+    // Moves the items to dest, leaving this sequence empty, if they're its
+    // own rather than shared with a root, and otherwise copies them.
+    void moveItemsTo(malValueIter dest);
+
+    virtual void traceRefs(malTracer& tracer) const;
 
     malValuePtr first() const;
     virtual malValuePtr rest() const;
 
+    // The items from index on, as a list, which usually shares this
+    // sequence's items rather than copying them.
+    malValuePtr slice(int from) const;
+
+    // Sequences are immutable, so when one is used as a quasiquote template
+    // its rewritten form can be kept with it.
+    malValuePtr quasiquoted() const { return m_quasiquoted; }
+    void setQuasiquoted(malValuePtr form) const { m_quasiquoted = form; }
+
+protected:
+    // The subclass passes in its trailing storage, which these fill.
+    malSequence(malType type, malValuePtr* storage, malValueVec* items);
+    malSequence(malType type, malValuePtr* storage,
+                malValueIter begin, malValueIter end);
+    malSequence(const malSequence& that, malValuePtr* storage,
+                malValuePtr meta);
+    malSequence(malType type, const malSequence* root, int from, int count);
+    // For sequences with no array of items until flatItems makes one.
+    malSequence(malType type, int count, malValuePtr meta);
+
+    virtual const malValuePtr& lookup(int index) const;
+    virtual malValueIter flatItems() const;
+    void setFlatItems(malValuePtr list) const;
+
+    bool ownsItems() const { return m_items && !m_root; }
+
+    // After a change in place: forgets what was cached about the items,
+    // including any array of them made on demand.
+    void itemsChanged(int count);
+
 private:
-    malValueVec* const m_items;
+    mutable malValuePtr* m_items;
+    int m_count;
+    // A slice has no storage of its own, and keeps alive the sequence
+    // whose items it shares. That's always one holding storage, so slices
+    // of slices don't chain.
+    mutable malValuePtr m_root;
+    mutable size_t m_hash;
+    mutable malValuePtr m_quasiquoted;
 };
 
+#define SEQUENCE_STORAGE reinterpret_cast<malValuePtr*>(this + 1)
+
 class malList : public malSequence {
 public:
-    malList(malValueVec* items) : malSequence(items) { }
+    malList(malValueVec* items)
+        : malSequence(MAL_LIST, SEQUENCE_STORAGE, items) { }
     malList(malValueIter begin, malValueIter end)
-        : malSequence(begin, end) { }
+        : malSequence(MAL_LIST, SEQUENCE_STORAGE, begin, end) { }
     malList(const malList& that, malValuePtr meta)
-        : malSequence(that, meta) { }
+        : malSequence(that, SEQUENCE_STORAGE, meta) { }
+    malList(const malSequence* root, int from, int count)
+        : malSequence(MAL_LIST, root, from, count) { }
+
+    TYPE_TAG(MAL_LIST);
 
     virtual String print(bool readably) const;
     virtual malValuePtr eval(malEnvPtr env);
 
     virtual malValuePtr conj(malValueIter argsBegin,
                              malValueIter argsEnd) const;
+    virtual malValuePtr conjUnique(malValueIter argsBegin,
+                                   malValueIter argsEnd);
 
-    WITH_META(malList);
+    virtual malValuePtr doWithMeta(malValuePtr meta) const {
+        return new (count()) malList(*this, meta);
+    }
 };
 
 class malVector : public malSequence {
 public:
-    malVector(malValueVec* items) : malSequence(items) { }
+    malVector(malValueVec* items)
+        : malSequence(MAL_VECTOR, SEQUENCE_STORAGE, items) { }
     malVector(malValueIter begin, malValueIter end)
-        : malSequence(begin, end) { }
+        : malSequence(MAL_VECTOR, SEQUENCE_STORAGE, begin, end) { }
     malVector(const malVector& that, malValuePtr meta)
-        : malSequence(that, meta) { }
+        : malSequence(that, SEQUENCE_STORAGE, meta) { }
+    malVector(malVectorTrie trie, malValuePtr meta)
+        : malSequence(MAL_VECTOR, trie.count(), std::move(meta))
+        , m_trie(std::move(trie)) {
+        if (m_trie.mayCycle()) {
+            setMayCycle();
+        }
+    }
+
+    TYPE_TAG(MAL_VECTOR);
 
     virtual malValuePtr eval(malEnvPtr env);
     virtual String print(bool readably) const;
 
+    malValuePtr assoc(malValueIter argsBegin, malValueIter argsEnd) const;
+    malValuePtr assocUnique(malValueIter argsBegin, malValueIter argsEnd);
     virtual malValuePtr conj(malValueIter argsBegin,
                              malValueIter argsEnd) const;
+    virtual malValuePtr conjUnique(malValueIter argsBegin,
+                                   malValueIter argsEnd);
+
+    virtual malValuePtr doWithMeta(malValuePtr meta) const;
+
+    malValuePtr transient() const;
 
-    WITH_META(malVector);
+    virtual void traceRefs(malTracer& tracer) const;
+
+protected:
+    virtual const malValuePtr& lookup(int index) const;
+    virtual malValueIter flatItems() const;
+
+private:
+    // Only vectors too big to copy cheaply use the trie, and the rest
+    // keep their items flat.
+    static const int FLAT_LIMIT = malTrieNode::WIDTH;
+    bool isTrie() const { return m_trie.count() > 0; }
+    malVectorTrie trie() const;
+    malValuePtr changedInPlace();
+
+    malVectorTrie m_trie;
+};
+
+#undef SEQUENCE_STORAGE
+
+class malLambda;
+
+// Some evaluators analyse the body of a lambda up front, and keep the
+// result alongside the lambda so that calls don't need to revisit the AST.
+// The code is tagged with the evaluator it's for, so that each can find its
+// own without RTTI.
+enum malCodeType {
+    MAL_CODE_NODES,     // a tree of nodes, from stepA_mal.cpp
+    MAL_CODE_VM,        // a vmClosure
 };
 
+class malCode : public RefCounted {
+public:
+    malCode(malCodeType type) : m_type(type) { }
+
+    malCodeType type() const { return m_type; }
+
+    virtual malValuePtr apply(const malLambda* lambda,
+                              malValueIter argsBegin,
+                              malValueIter argsEnd) const = 0;
+
+private:
+    const malCodeType m_type;
+};
+
+typedef RefCountedPtr<malCode> malCodePtr;
+
 class malApplicable : public malValue {
 public:
-    malApplicable() { }
-    malApplicable(malValuePtr meta) : malValue(meta) { }
+    malApplicable(malType type) : malValue(type) { }
+    malApplicable(malType type, malValuePtr meta) : malValue(type, meta) { }
+
+    static bool hasType(malType type) {
+        return type == MAL_BUILTIN || type == MAL_LAMBDA;
+    }
 
     virtual malValuePtr apply(malValueIter argsBegin,
                                malValueIter argsEnd) const = 0;
@@ -232,30 +483,52 @@ public:
 
 class malHash : public malValue {
 public:
-    typedef std::map<String, malValuePtr> Map;
-
     malHash(malValueIter argsBegin, malValueIter argsEnd, bool isEvaluated);
-    malHash(const malHash::Map& map);
+    malHash(malHashTrie map);
     malHash(const malHash& that, malValuePtr meta)
-    : malValue(meta), m_map(that.m_map), m_isEvaluated(that.m_isEvaluated) { }
+    : malValue(MAL_HASH, meta), m_map(that.m_map)
+    , m_isEvaluated(that.m_isEvaluated), m_hash(that.m_hash) {
+        if (m_map.mayCycle()) {
+            setMayCycle();
+        }
+    }
+
+    TYPE_TAG(MAL_HASH);
 
     malValuePtr assoc(malValueIter argsBegin, malValueIter argsEnd) const;
     malValuePtr dissoc(malValueIter argsBegin, malValueIter argsEnd) const;
-    bool contains(malValuePtr key) const;
+
+    // For a map that nothing else refers to, which is changed in place.
+    malValuePtr assocUnique(malValueIter argsBegin, malValueIter argsEnd);
+    malValuePtr dissocUnique(malValueIter argsBegin, malValueIter argsEnd);
+
+    bool contains(const malValuePtr& key) const;
     malValuePtr eval(malEnvPtr env);
-    malValuePtr get(malValuePtr key) const;
+    bool isEvaluated() const { return m_isEvaluated; }
+    malValuePtr get(const malValuePtr& key) const;
     malValuePtr keys() const;
     malValuePtr values() const;
+    malValuePtr transient() const;
 
     virtual String print(bool readably) const;
 
     virtual bool doIsEqualTo(const malValue* rhs) const;
+    bool compareItems(const malHash* rhs, malComparisons& pending) const;
+    virtual size_t hash() const;
+    bool isHashed() const { return m_hash != 0; }
+    void addUnhashedItems(malHashings& pending) const;
+    void hashItems() const;
+
+    virtual void traceRefs(malTracer& tracer) const;
 
     WITH_META(malHash);
 
 private:
-    const Map m_map;
+    malValuePtr changedInPlace();
+
+    malHashTrie m_map;
     const bool m_isEvaluated;
+    mutable size_t m_hash;
 };
 
 class malBuiltIn : public malApplicable {
@@ -264,11 +537,17 @@ public:
                                     malValueIter argsBegin,
                                     malValueIter argsEnd);
 
-    malBuiltIn(const String& name, ApplyFunc* handler)
-    : m_name(name), m_handler(handler) { }
+    malBuiltIn(const String& name, ApplyFunc* handler,
+               bool updatesInPlace = false)
+    : malApplicable(MAL_BUILTIN), m_name(name), m_handler(handler)
+    , m_updatesInPlace(updatesInPlace) { }
 
     malBuiltIn(const malBuiltIn& that, malValuePtr meta)
-    : malApplicable(meta), m_name(that.m_name), m_handler(that.m_handler) { }
+    : malApplicable(MAL_BUILTIN, meta)
+    , m_name(that.m_name), m_handler(that.m_handler)
+    , m_updatesInPlace(that.m_updatesInPlace) { }
+
+    TYPE_TAG(MAL_BUILTIN);
 
     virtual malValuePtr apply(malValueIter argsBegin,
                               malValueIter argsEnd) const;
@@ -283,23 +562,34 @@ public:
 
     String name() const { return m_name; }
 
+    // Whether it updates its first argument in place when nothing else
+    // refers to it.
+    bool updatesInPlace() const { return m_updatesInPlace; }
+
     WITH_META(malBuiltIn);
 
 private:
     const String m_name;
     ApplyFunc* m_handler;
+    const bool m_updatesInPlace;
 };
 
 class malLambda : public malApplicable {
 public:
     malLambda(const StringVec& bindings, malValuePtr body, malEnvPtr env);
+    malLambda(const SymbolIdVec& bindings, malValuePtr body, malEnvPtr env,
+              malCodePtr code = NULL);
     malLambda(const malLambda& that, malValuePtr meta);
     malLambda(const malLambda& that, bool isMacro);
 
+    TYPE_TAG(MAL_LAMBDA);
+
     virtual malValuePtr apply(malValueIter argsBegin,
                               malValueIter argsEnd) const;
 
     malValuePtr getBody() const { return m_body; }
+    const malCodePtr& getCode() const { return m_code; }
+    const malEnvPtr& getEnv() const { return m_env; }
     malEnvPtr makeEnv(malValueIter argsBegin, malValueIter argsEnd) const;
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
@@ -314,18 +604,24 @@ public:
 
     virtual malValuePtr doWithMeta(malValuePtr meta) const;
 
+    virtual void traceRefs(malTracer& tracer) const;
+
 private:
-    const StringVec   m_bindings;
+    const SymbolIdVec m_bindings;
     const malValuePtr m_body;
+    const malCodePtr  m_code;
     const malEnvPtr   m_env;
     const bool        m_isMacro;
 };
 
 class malAtom : public malValue {
 public:
-    malAtom(malValuePtr value) : m_value(value) { }
+    malAtom(malValuePtr value)
+        : malValue(MAL_ATOM), m_value(std::move(value)) { setMayCycle(); }
     malAtom(const malAtom& that, malValuePtr meta)
-        : malValue(meta), m_value(that.m_value) { }
+        : malValue(MAL_ATOM, meta), m_value(that.m_value) { setMayCycle(); }
+
+    TYPE_TAG(MAL_ATOM);
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
         return this->m_value->isEqualTo(rhs);
@@ -337,7 +633,13 @@ public:
 
     malValuePtr deref() const { return m_value; }
 
-    malValuePtr reset(malValuePtr value) { return m_value = value; }
+    malValuePtr reset(malValuePtr value) {
+        m_value = std::move(value);
+        return m_value;
+    }
+
+    virtual void traceRefs(malTracer& tracer) const;
+    virtual void dropRefs() { m_value = malValuePtr(); }
 
     WITH_META(malAtom);
 
@@ -345,30 +647,196 @@ private:
     malValuePtr m_value;
 };
 
+// A vector or hash-map being built up by conj!, assoc! and dissoc!, which
+// change the transient itself rather than making a new value. It starts
+// out sharing the trie of the value it was made from, and as with the
+// ...Unique functions, only nodes that nothing else refers to are changed
+// in place, so the original never sees a change. persistent! hands the
+// trie over to a new value, and the transient can't be used after that,
+// so nothing can change the new value either.
+class malTransient : public malValue {
+public:
+    malTransient(malVectorTrie items);
+    malTransient(malHashTrie map);
+
+    TYPE_TAG(MAL_TRANSIENT);
+
+    malValuePtr conj(malValueIter argsBegin, malValueIter argsEnd);
+    malValuePtr assoc(malValueIter argsBegin, malValueIter argsEnd);
+    malValuePtr dissoc(malValueIter argsBegin, malValueIter argsEnd);
+    malValuePtr persistent();
+
+    int count() const;
+    malValuePtr nth(int64_t index) const;
+    malValuePtr get(const malValuePtr& key) const;
+    bool contains(const malValuePtr& key) const;
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return this == rhs;
+    }
+
+    virtual String print(bool readably) const {
+        return STRF("#transient-%s(%p)",
+                    m_isVector ? "vector" : "hash-map", this);
+    }
+
+    virtual malValuePtr doWithMeta(malValuePtr meta) const;
+
+    // It can hold itself, as it's changed after it's made.
+    virtual void traceRefs(malTracer& tracer) const;
+    virtual void dropRefs();
+
+private:
+    void checkEditable(const char* name) const;
+
+    const bool      m_isVector;
+    bool            m_isEditable;
+    malVectorTrie   m_items;
+    malHashTrie     m_map;
+};
+
+// The members of malValuePtr which need the complete value types.
+
+inline malValuePtr::malValuePtr(malValue* object)
+    : m_word(reinterpret_cast<uintptr_t>(object))
+{
+    acquire();
+}
+
+inline malValuePtr::malValuePtr(const malValuePtr& rhs)
+    : m_word(rhs.m_word)
+{
+    acquire();
+}
+
+inline malValuePtr::~malValuePtr()
+{
+    release(m_word);
+}
+
+inline const malValuePtr& malValuePtr::operator = (const malValuePtr& rhs)
+{
+    rhs.acquire();
+    uintptr_t old = m_word;
+    m_word = rhs.m_word;
+    release(old);
+    return *this;
+}
+
+inline const malValuePtr& malValuePtr::operator = (malValuePtr&& rhs)
+{
+    uintptr_t old = m_word;
+    m_word = rhs.m_word;
+    rhs.m_word = 0;
+    release(old);
+    return *this;
+}
+
+inline void malValuePtr::acquire() const
+{
+    if ((m_word != 0) && !isImmediate() && !object()->isImmortal()) {
+        object()->acquire();
+    }
+}
+
+inline void malValuePtr::release(uintptr_t word)
+{
+    malValue* object = reinterpret_cast<malValue*>(word);
+    if ((word != 0) && !(word & IMMEDIATE_MASK) && !object->isImmortal()) {
+        object->release();
+    }
+}
+
+inline malType malValuePtr::type() const
+{
+    if (m_word & INTEGER_TAG) {
+        return MAL_INTEGER;
+    }
+    if (m_word & CONSTANT_TAG) {
+        return MAL_CONSTANT;
+    }
+    return object()->type();
+}
+
+inline int64_t malValuePtr::intValue() const
+{
+    if (m_word & INTEGER_TAG) {
+        return static_cast<int64_t>(m_word) >> 1;
+    }
+    return static_cast<const malInteger*>(object())->value();
+}
+
+inline size_t malValuePtr::hash() const
+{
+    if (m_word & INTEGER_TAG) {
+        return malInteger::hashOf(intValue());
+    }
+    return (m_word & CONSTANT_TAG) ? m_word : object()->hash();
+}
+
+inline bool malValuePtr::mayCycle() const
+{
+    return (m_word != 0) && !isImmediate() && object()->mayCycle();
+}
+
+inline malValueArrow malValuePtr::operator -> () const
+{
+    if (m_word & INTEGER_TAG) {
+        return malValueArrow(boxInteger(intValue()));
+    }
+    return malValueArrow(ptr());
+}
+
+inline malValue* malValuePtr::ptr() const
+{
+    ASSERT(!(m_word & INTEGER_TAG), "%s\n", "Immediate integer has no object");
+    return (m_word & CONSTANT_TAG) ? constantObject(m_word) : object();
+}
+
 namespace mal {
     malValuePtr atom(malValuePtr value);
-    malValuePtr boolean(bool value);
     malValuePtr builtin(const String& name, malBuiltIn::ApplyFunc handler);
-    malValuePtr falseValue();
     malValuePtr hash(malValueIter argsBegin, malValueIter argsEnd,
                      bool isEvaluated);
-    malValuePtr hash(const malHash::Map& map);
-    malValuePtr integer(int64_t value);
+    malValuePtr hash(malHashTrie map);
     malValuePtr integer(const String& token);
     malValuePtr keyword(const String& token);
     malValuePtr lambda(const StringVec&, malValuePtr, malEnvPtr);
+    malValuePtr lambda(const SymbolIdVec&, malValuePtr, malEnvPtr,
+                       malCodePtr code = NULL);
     malValuePtr list(malValueVec* items);
     malValuePtr list(malValueIter begin, malValueIter end);
     malValuePtr list(malValuePtr a);
     malValuePtr list(malValuePtr a, malValuePtr b);
     malValuePtr list(malValuePtr a, malValuePtr b, malValuePtr c);
     malValuePtr macro(const malLambda& lambda);
-    malValuePtr nilValue();
     malValuePtr string(const String& token);
     malValuePtr symbol(const String& token);
-    malValuePtr trueValue();
+    malValuePtr symbol(SymbolId id);
     malValuePtr vector(malValueVec* items);
     malValuePtr vector(malValueIter begin, malValueIter end);
+
+    inline malValuePtr nilValue() {
+        return malValuePtr::constant(malValuePtr::CONST_NIL);
+    }
+
+    inline malValuePtr trueValue() {
+        return malValuePtr::constant(malValuePtr::CONST_TRUE);
+    }
+
+    inline malValuePtr falseValue() {
+        return malValuePtr::constant(malValuePtr::CONST_FALSE);
+    }
+
+    inline malValuePtr boolean(bool value) {
+        return value ? trueValue() : falseValue();
+    }
+
+    inline malValuePtr integer(int64_t value) {
+        return malValuePtr::fitsInteger(value)
+            ? malValuePtr::integer(value)
+            : malValuePtr(new malInteger(value));
+    }
 };
 
 #endif // INCLUDE_TYPES_H
@@ -0,0 +1,671 @@
+#include "VM.h"
+#include "Collector.h"
+#include "Environment.h"
+
+#include <algorithm>
+
+// gcc and clang can jump straight from one instruction to the next, which
+// is quicker than going back round a switch.
+#if defined(__GNUC__)
+#define VM_COMPUTED_GOTO
+#endif
+
+namespace {
+
+const int STACK_SIZE = 256 * 1024;
+
+struct vmFrame {
+    const vmClosure*    closure;
+    const uint8_t*      ip;
+    malValuePtr*        base;       // the first slot, just above the lambda
+};
+
+struct vmHandler {
+    size_t              frameCount;
+    malValuePtr*        sp;
+    const uint8_t*      catchIp;
+    const uint8_t*      endIp;
+};
+
+// The stack is never resized, so that the arguments passed to builtins
+// can refer to it directly. Everything at or above the stack pointer is
+// kept NULL.
+malValueVec             s_stack(STACK_SIZE);
+malValuePtr*            s_sp = &s_stack[0];
+malValuePtr* const      s_stackEnd = &s_stack[0] + STACK_SIZE;
+std::vector<vmFrame>    s_frames;
+std::vector<vmHandler>  s_handlers;
+
+}
+
+static void clearStack(malValuePtr* from, malValuePtr*& sp)
+{
+    while (sp > from) {
+        *--sp = malValuePtr();
+    }
+}
+
+static const vmClosure* vmClosureOf(const malValuePtr& op)
+{
+    const malLambda* lambda = DYNAMIC_CAST(malLambda, op);
+    if (!lambda) {
+        return NULL;
+    }
+    const malCode* code = lambda->getCode().ptr();
+    return (code && code->type() == MAL_CODE_VM)
+        ? static_cast<const vmClosure*>(code) : NULL;
+}
+
+// Sets up a frame for the closure, whose arguments are on the stack from
+// base up to sp. Returns the new stack pointer.
+static malValuePtr* enterClosure(const vmClosure* closure,
+                                 malValuePtr* base, malValuePtr* sp)
+{
+    const vmProto* proto = closure->proto.ptr();
+    MAL_CHECK(base + proto->stackSize < s_stackEnd, "Stack overflow");
+
+    int argCount = sp - base;
+    if (proto->isVariadic) {
+        MAL_CHECK(argCount >= proto->arity, "Not enough parameters");
+        malValuePtr* rest = base + proto->arity;
+        malValuePtr restList = mal::list(rest, sp);
+        clearStack(rest, sp);
+        *sp++ = std::move(restList);
+    }
+    else {
+        MAL_CHECK(argCount == proto->arity,
+                  argCount < proto->arity ? "Not enough parameters"
+                                          : "Too many parameters");
+    }
+
+    for (int slot : proto->boxedParams) {
+        base[slot] = new malAtom(std::move(base[slot]));
+    }
+    return base + proto->slotCount;
+}
+
+static malValuePtr getGlobal(const vmClosure* closure, SymbolId id)
+{
+    return closure->env->get(id);
+}
+
+// Reads the variable at offset when the binding it was compiled to hasn't
+// been set, from the bindings that it shadows.
+static malValuePtr getShadowed(const vmClosure* closure,
+                               const malValuePtr* base, int offset)
+{
+    const vmVarName& name = closure->proto->findVarName(offset);
+    for (auto& outer : name.shadowed) {
+        malValuePtr value;
+        if (outer.local) {
+            value = base[outer.local->slot];
+            if (value && outer.local->isCaptured) {
+                value = STATIC_CAST(malAtom, value)->deref();
+            }
+        }
+        else {
+            value = STATIC_CAST(malAtom, closure->upvalues[outer.upvalue])
+                        ->deref();
+        }
+        if (value) {
+            return value;
+        }
+    }
+    return getGlobal(closure, name.id);
+}
+
+static const malValuePtr& cellValue(const malCell* cell)
+{
+    const malValuePtr& value = cell->value();
+    MAL_CHECK(value, "'%s' not found", symbolName(cell->id()).c_str());
+    return value;
+}
+
+// The operator of a call has turned out to be a macro, which wasn't known
+// when the call was compiled. Expand the form, and compile the expansion as
+// a function of the variables the call can see, which are passed to it by
+// OP_EXPANDED. Returns the lambda.
+static malValuePtr expandLateMacro(const vmClosure* closure,
+                                   vmCallSite& site, const malLambda* macro)
+{
+    const vmProto* proto = closure->proto.ptr();
+    SymbolIdVec params;
+    std::vector<int> upvalues;
+
+    for (auto& local : site.locals) {
+        params.push_back(local->id);
+    }
+    for (size_t i = 0; i < proto->upvalues.size(); i++) {
+        SymbolId id = proto->upvalues[i].id;
+        if (std::find(params.begin(), params.end(), id) == params.end()) {
+            params.push_back(id);
+            upvalues.push_back(i);
+        }
+    }
+
+    const malList* form = STATIC_CAST(malList, site.form);
+    malValuePtr expansion = macroExpand(
+        macro->apply(form->begin() + 1, form->end()), closure->env);
+    vmProtoPtr lifted = vmCompileLifted(expansion, params, site.blockLocals,
+                                        closure->env);
+    malCodePtr code(new vmClosure(lifted, closure->env));
+    site.upvalues = upvalues;
+    return mal::lambda(params, expansion, closure->env, code);
+}
+
+// Pushes the variables visible at a call site, as the arguments of its
+// expansion. The locals that the expansion shares are passed in boxes, and
+// returns true if some of those have to be copied back afterwards, as they
+// aren't captured and so don't live in boxes here.
+static bool pushExpansionArgs(const vmClosure* closure, const vmCallSite* site,
+                              const vmProto* lifted, malValuePtr* base,
+                              malValuePtr*& sp)
+{
+    auto shared = lifted->sharedParams.begin();
+    auto sharedEnd = lifted->sharedParams.end();
+    bool isCopiedBack = false;
+    int index = 0;
+
+    for (auto& local : site->locals) {
+        malValuePtr& value = base[local->slot];
+        bool isShared = (shared != sharedEnd && *shared == index++);
+        if (isShared) {
+            ++shared;
+        }
+        if (!local->isCaptured) {
+            isCopiedBack |= isShared;
+            *sp++ = isShared ? new malAtom(value) : value;
+        }
+        else if (isShared) {
+            if (!value) {
+                value = new malAtom(malValuePtr());
+            }
+            *sp++ = value;
+        }
+        else {
+            *sp++ = value ? STATIC_CAST(malAtom, value)->deref() : value;
+        }
+    }
+    for (int upvalue : site->upvalues) {
+        *sp++ = STATIC_CAST(malAtom, closure->upvalues[upvalue])->deref();
+    }
+    return isCopiedBack;
+}
+
+// Copies the shared variables which aren't captured back into their slots,
+// from the boxes pushed by pushExpansionArgs.
+static void copyBackExpansionArgs(const vmCallSite* site, const vmProto* lifted,
+                                  malValuePtr* base, const malValuePtr* args)
+{
+    for (int index : lifted->sharedParams) {
+        if (!site->locals[index]->isCaptured) {
+            base[site->locals[index]->slot] =
+                STATIC_CAST(malAtom, args[index])->deref();
+        }
+    }
+}
+
+// Runs the lambda in calleeSlot, with its arguments on the stack above it,
+// until it returns.
+static malValuePtr run(malValuePtr* calleeSlot, malValuePtr* sp)
+{
+#ifdef VM_COMPUTED_GOTO
+    static void* dispatchTable[] = {
+        &&L_OP_CONST,
+        &&L_OP_NIL,
+        &&L_OP_TRUE,
+        &&L_OP_FALSE,
+        &&L_OP_POP,
+        &&L_OP_DUP,
+        &&L_OP_GET_LOCAL,
+        &&L_OP_SET_LOCAL,
+        &&L_OP_GET_BOXED,
+        &&L_OP_SET_BOXED,
+        &&L_OP_DECLARE,
+        &&L_OP_BOX,
+        &&L_OP_GET_UPVALUE,
+        &&L_OP_GET_GLOBAL,
+        &&L_OP_GET_CALLEE,
+        &&L_OP_CHECK_CALLEE,
+        &&L_OP_EXPANDED,
+        &&L_OP_DEF_GLOBAL,
+        &&L_OP_MACRO,
+        &&L_OP_JUMP,
+        &&L_OP_JUMP_IF_FALSE,
+        &&L_OP_CALL,
+        &&L_OP_TAIL_CALL,
+        &&L_OP_RETURN,
+        &&L_OP_CLOSURE,
+        &&L_OP_VECTOR,
+        &&L_OP_HASH,
+        &&L_OP_TRY,
+        &&L_OP_END_TRY,
+        &&L_OP_MACROEXPAND,
+        &&L_OP_THROW,
+        &&L_OP_THROW_VALUE,
+    };
+    static_assert(sizeof(dispatchTable) / sizeof(dispatchTable[0])
+                    == OP_THROW_VALUE + 1,
+                  "dispatchTable is out of step with vmOpCode");
+#define CASE(op)    L_##op:
+#define DISPATCH()  goto *dispatchTable[*ip++]
+#else
+#define CASE(op)    case op:
+#define DISPATCH()  break
+#endif
+#define READ_ARG()  (ip += 2, ip[-2] | (ip[-1] << 8))
+#define LOAD_FRAME(frame)                                                   \
+    do {                                                                    \
+        closure = (frame).closure;                                          \
+        ip = (frame).ip;                                                    \
+        base = (frame).base;                                                \
+        constants = closure->proto->constants.data();                       \
+        cells = closure->proto->cells.data();                               \
+    } while (0)
+
+    const size_t entryFrames = s_frames.size();
+    const size_t entryHandlers = s_handlers.size();
+    const malValuePtr nilValue = mal::nilValue();
+    const malValuePtr trueValue = mal::trueValue();
+    const malValuePtr falseValue = mal::falseValue();
+
+    const vmClosure* closure = NULL;
+    const uint8_t* ip = NULL;
+    malValuePtr* base = NULL;
+    const malValuePtr* constants = NULL;
+    const malCellPtr* cells = NULL;
+    int argCount;
+    const vmCallSite* site;
+
+    for (;;) {
+    try {
+        if (!closure) {
+            const vmClosure* callee = vmClosureOf(*calleeSlot);
+            sp = enterClosure(callee, calleeSlot + 1, sp);
+            s_frames.push_back(vmFrame {
+                callee, callee->proto->code.data(), calleeSlot + 1 });
+            LOAD_FRAME(s_frames.back());
+        }
+
+#ifdef VM_COMPUTED_GOTO
+        DISPATCH();
+#else
+        for (;;) switch (*ip++) {
+#endif
+
+        CASE(OP_CONST) {
+            *sp++ = constants[READ_ARG()];
+        } DISPATCH();
+
+        CASE(OP_NIL) {
+            *sp++ = nilValue;
+        } DISPATCH();
+
+        CASE(OP_TRUE) {
+            *sp++ = trueValue;
+        } DISPATCH();
+
+        CASE(OP_FALSE) {
+            *sp++ = falseValue;
+        } DISPATCH();
+
+        CASE(OP_POP) {
+            *--sp = malValuePtr();
+        } DISPATCH();
+
+        CASE(OP_DUP) {
+            *sp = sp[-1];
+            sp++;
+        } DISPATCH();
+
+        CASE(OP_GET_LOCAL) {
+            int offset = ip - 1 - closure->proto->code.data();
+            const malValuePtr& value = base[READ_ARG()];
+            // The local may have been defined in code that hasn't run.
+            *sp++ = value ? value : getShadowed(closure, base, offset);
+        } DISPATCH();
+
+        CASE(OP_SET_LOCAL) {
+            base[READ_ARG()] = std::move(*--sp);
+        } DISPATCH();
+
+        CASE(OP_GET_BOXED) {
+            int offset = ip - 1 - closure->proto->code.data();
+            const malValuePtr& box = base[READ_ARG()];
+            malValuePtr value;
+            if (box) {
+                value = STATIC_CAST(malAtom, box)->deref();
+            }
+            *sp++ = value ? value : getShadowed(closure, base, offset);
+        } DISPATCH();
+
+        CASE(OP_SET_BOXED) {
+            malValuePtr& box = base[READ_ARG()];
+            if (!box) {
+                box = new malAtom(malValuePtr());
+            }
+            STATIC_CAST(malAtom, box)->reset(std::move(*--sp));
+        } DISPATCH();
+
+        CASE(OP_DECLARE) {
+            base[READ_ARG()] = malValuePtr();
+        } DISPATCH();
+
+        CASE(OP_BOX) {
+            base[READ_ARG()] = new malAtom(malValuePtr());
+        } DISPATCH();
+
+        CASE(OP_GET_UPVALUE) {
+            int offset = ip - 1 - closure->proto->code.data();
+            malValuePtr value =
+                STATIC_CAST(malAtom, closure->upvalues[READ_ARG()])->deref();
+            *sp++ = value ? value : getShadowed(closure, base, offset);
+        } DISPATCH();
+
+        CASE(OP_GET_GLOBAL) {
+            *sp++ = cellValue(cells[READ_ARG()].ptr());
+        } DISPATCH();
+
+        CASE(OP_GET_CALLEE) {
+            int offset = ip - 1 - closure->proto->code.data();
+            const malValuePtr& op = cellValue(cells[READ_ARG()].ptr());
+            const malLambda* lambda = DYNAMIC_CAST(malLambda, op);
+            if (!lambda || !lambda->isMacro()) {
+                *sp++ = op;
+                DISPATCH();
+            }
+
+            vmProto* proto = closure->proto.ptr();
+            int index = proto->findCallSite(offset);
+            vmCallSite& callSite = proto->callSites[index];
+            malValuePtr macro = op;
+            s_sp = sp;
+            s_frames.back().ip = ip;
+            callSite.expansion = expandLateMacro(closure, callSite,
+                                                 STATIC_CAST(malLambda, macro));
+
+            uint8_t* code = proto->code.data();
+            code[offset] = OP_EXPANDED;
+            code[offset + 1] = index & 0xff;
+            code[offset + 2] = index >> 8;
+            ip = code + offset;
+        } DISPATCH();
+
+        CASE(OP_CHECK_CALLEE) {
+            int offset = ip - 1 - closure->proto->code.data();
+            const malLambda* lambda = DYNAMIC_CAST(malLambda, sp[-1]);
+            if (!lambda || !lambda->isMacro()) {
+                DISPATCH();
+            }
+
+            // The expansion is only good for this macro, so the call is
+            // left as it is.
+            vmProto* proto = closure->proto.ptr();
+            vmCallSite& callSite = proto->callSites[proto->findCallSite(offset)];
+            s_sp = sp;
+            s_frames.back().ip = ip;
+            sp[-1] = expandLateMacro(closure, callSite, lambda);
+            site = &callSite;
+            goto doExpanded;
+        }
+
+        CASE(OP_EXPANDED) {
+            site = &closure->proto->callSites[READ_ARG()];
+            *sp++ = site->expansion;
+        doExpanded:
+            argCount = site->locals.size() + site->upvalues.size();
+            MAL_CHECK(sp + argCount < s_stackEnd, "Stack overflow");
+            const vmProto* lifted = vmClosureOf(sp[-1])->proto.ptr();
+            bool isCopiedBack =
+                pushExpansionArgs(closure, site, lifted, base, sp);
+
+            // Carry on as the call would have, after the call instruction.
+            // Nothing reads this frame after a tail call.
+            ip = closure->proto->code.data() + site->end;
+            if (ip[-3] == OP_TAIL_CALL) {
+                goto doTailCall;
+            }
+            if (!isCopiedBack) {
+                goto doCall;
+            }
+
+            // Otherwise run it here, so the variables it def!s can be copied
+            // back once it returns.
+            malValuePtr* callee = sp - argCount - 1;
+            s_sp = sp;
+            s_frames.back().ip = ip;
+            malValuePtr result = APPLY(*callee, callee + 1, sp);
+            copyBackExpansionArgs(site, lifted, base, callee + 1);
+            clearStack(callee, sp);
+            *sp++ = std::move(result);
+        } DISPATCH();
+
+        CASE(OP_DEF_GLOBAL) {
+            cells[READ_ARG()]->set(sp[-1]);
+        } DISPATCH();
+
+        CASE(OP_MACRO) {
+            const malLambda* lambda = VALUE_CAST(malLambda, sp[-1]);
+            sp[-1] = mal::macro(*lambda);
+        } DISPATCH();
+
+        CASE(OP_JUMP) {
+            int offset = READ_ARG();
+            ip += offset;
+        } DISPATCH();
+
+        CASE(OP_JUMP_IF_FALSE) {
+            int offset = READ_ARG();
+            malValuePtr value = std::move(*--sp);
+            if (value == nilValue || value == falseValue) {
+                ip += offset;
+            }
+        } DISPATCH();
+
+        CASE(OP_CALL) {
+            argCount = READ_ARG();
+        doCall:
+            malValuePtr* callee = sp - argCount - 1;
+            if (const vmClosure* target = vmClosureOf(*callee)) {
+                s_frames.back().ip = ip;
+                sp = enterClosure(target, callee + 1, sp);
+                s_frames.push_back(vmFrame {
+                    target, target->proto->code.data(), callee + 1 });
+                LOAD_FRAME(s_frames.back());
+                malCollector::collectIfDue();
+                DISPATCH();
+            }
+
+            s_sp = sp;
+            s_frames.back().ip = ip;
+            malValuePtr result = APPLY(*callee, callee + 1, sp);
+            clearStack(callee, sp);
+            *sp++ = std::move(result);
+        } DISPATCH();
+
+        CASE(OP_TAIL_CALL) {
+            argCount = READ_ARG();
+        doTailCall:
+            malValuePtr* callee = sp - argCount - 1;
+            if (const vmClosure* target = vmClosureOf(*callee)) {
+                // Slide the callee and its arguments down over this frame.
+                malValuePtr* dest = base - 1;
+                if (callee != dest) {
+                    for (int i = 0; i <= argCount; i++) {
+                        dest[i] = std::move(callee[i]);
+                    }
+                    clearStack(dest + argCount + 1, sp);
+                }
+                sp = enterClosure(target, base, base + argCount);
+                s_frames.back() = vmFrame {
+                    target, target->proto->code.data(), base };
+                LOAD_FRAME(s_frames.back());
+                malCollector::collectIfDue();
+                DISPATCH();
+            }
+
+            s_sp = sp;
+            s_frames.back().ip = ip;
+            malValuePtr result = APPLY(*callee, callee + 1, sp);
+            clearStack(callee, sp);
+            *sp++ = std::move(result);
+            goto doReturn;
+        }
+
+        CASE(OP_RETURN)
+        doReturn: {
+            malValuePtr result = std::move(sp[-1]);
+            clearStack(base - 1, sp);
+            s_frames.pop_back();
+            if (s_frames.size() == entryFrames) {
+                s_sp = sp;
+                return result;
+            }
+            *sp++ = std::move(result);
+            LOAD_FRAME(s_frames.back());
+        } DISPATCH();
+
+        CASE(OP_CLOSURE) {
+            const vmProtoPtr& proto = closure->proto->protos[READ_ARG()];
+            vmClosure* code = new vmClosure(proto, closure->env);
+            malCodePtr codePtr(code);
+            for (auto& upvalue : proto->upvalues) {
+                if (!upvalue.isLocal) {
+                    code->upvalues.push_back(closure->upvalues[upvalue.index]);
+                    continue;
+                }
+                malValuePtr& box = base[upvalue.index];
+                if (!box) {
+                    box = new malAtom(malValuePtr());
+                }
+                code->upvalues.push_back(box);
+            }
+            *sp++ = mal::lambda(proto->params, proto->body,
+                                closure->env, codePtr);
+        } DISPATCH();
+
+        CASE(OP_VECTOR) {
+            int count = READ_ARG();
+            malValuePtr vector = mal::vector(sp - count, sp);
+            clearStack(sp - count, sp);
+            *sp++ = std::move(vector);
+        } DISPATCH();
+
+        CASE(OP_HASH) {
+            int count = READ_ARG();
+            malValuePtr hash = mal::hash(sp - count, sp, true);
+            clearStack(sp - count, sp);
+            *sp++ = std::move(hash);
+        } DISPATCH();
+
+        CASE(OP_TRY) {
+            int catchOffset = READ_ARG();
+            int endOffset = READ_ARG();
+            s_handlers.push_back(vmHandler {
+                s_frames.size(), sp, ip + catchOffset, ip + endOffset });
+        } DISPATCH();
+
+        CASE(OP_END_TRY) {
+            int offset = READ_ARG();
+            s_handlers.pop_back();
+            ip += offset;
+        } DISPATCH();
+
+        CASE(OP_MACROEXPAND) {
+            malValuePtr form = constants[READ_ARG()];
+            s_sp = sp;
+            s_frames.back().ip = ip;
+            *sp++ = macroExpand(form, closure->env);
+        } DISPATCH();
+
+        CASE(OP_THROW) {
+            throw STATIC_CAST(malString, constants[READ_ARG()])->value();
+        }
+
+        CASE(OP_THROW_VALUE) {
+            throw malValuePtr(constants[READ_ARG()]);
+        }
+
+#ifndef VM_COMPUTED_GOTO
+        }
+#endif
+    }
+    catch (...) {
+        malValuePtr excVal;
+        bool isEmptyInput = false;
+        try {
+            throw;
+        }
+        catch (String& s) {
+            excVal = mal::string(s);
+        }
+        catch (malEmptyInputException&) {
+            isEmptyInput = true;
+        }
+        catch (malValuePtr& o) {
+            excVal = o;
+        }
+        catch (...) {
+        }
+
+        if ((!excVal && !isEmptyInput)
+                || s_handlers.size() == entryHandlers) {
+            clearStack(calleeSlot, sp);
+            s_frames.resize(entryFrames);
+            s_sp = sp;
+            throw;
+        }
+
+        vmHandler handler = s_handlers.back();
+        s_handlers.pop_back();
+        clearStack(handler.sp, sp);
+        s_frames.resize(handler.frameCount);
+        LOAD_FRAME(s_frames.back());
+        if (isEmptyInput) {
+            // Not an error, continue as if we got nil
+            *sp++ = nilValue;
+            ip = handler.endIp;
+        }
+        else {
+            *sp++ = std::move(excVal);
+            ip = handler.catchIp;
+        }
+    }
+    }
+
+#undef CASE
+#undef DISPATCH
+#undef READ_ARG
+#undef LOAD_FRAME
+}
+
+malValuePtr vmClosure::apply(const malLambda* lambda,
+                             malValueIter argsBegin,
+                             malValueIter argsEnd) const
+{
+    malValuePtr* calleeSlot = s_sp;
+    int argCount = std::distance(argsBegin, argsEnd);
+    MAL_CHECK(calleeSlot + argCount + 1 < s_stackEnd, "Stack overflow");
+
+    malValuePtr* sp = calleeSlot;
+    *sp++ = const_cast<malLambda*>(lambda);
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        *sp++ = *it;
+    }
+    s_sp = sp;
+    return run(calleeSlot, sp);
+}
+
+void vmClosure::traceRefs(malTracer& tracer) const
+{
+    tracer(env);
+    tracer(upvalues);
+}
+
+malValuePtr vmEval(malValuePtr ast, malEnvPtr env)
+{
+    vmProtoPtr proto = vmCompile(ast, env);
+    malCodePtr code(new vmClosure(proto, env));
+    malValuePtr lambda = mal::lambda(SymbolIdVec(), ast, env, code);
+    return APPLY(lambda, NULL, NULL);
+}
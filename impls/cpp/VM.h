@@ -0,0 +1,179 @@
+#ifndef INCLUDE_VM_H
+#define INCLUDE_VM_H
+
+#include "MAL.h"
+#include "Environment.h"
+#include "SymbolTable.h"
+#include "Types.h"
+
+#include <stdint.h>
+
+// An alternative to the tree-walking evaluator: forms are compiled into a
+// compact bytecode, and run by a stack machine. Function parameters and
+// let* bindings live in slots on the VM stack rather than in malEnvs, and
+// closures capture just the variables they use.
+
+// Provided by stepA_mal.cpp, which owns the definition of these forms.
+extern malValuePtr quasiquote(malValuePtr obj);
+extern malValuePtr macroExpand(malValuePtr obj, malEnvPtr env);
+
+// Compiles and runs ast as a top-level form, with env as the global
+// environment.
+extern malValuePtr vmEval(malValuePtr ast, malEnvPtr env);
+
+// Instructions are a single byte, followed by any 16-bit operands.
+enum vmOpCode {
+    OP_CONST,           // k        push constants[k]
+    OP_NIL,             //          push nil
+    OP_TRUE,            //          push true
+    OP_FALSE,           //          push false
+    OP_POP,             //          discard the top of the stack
+    OP_DUP,             //          duplicate the top of the stack
+    OP_GET_LOCAL,       // slot     push a local
+    OP_SET_LOCAL,       // slot     pop into a local
+    OP_GET_BOXED,       // slot     push the value of a captured local
+    OP_SET_BOXED,       // slot     pop into a captured local
+    OP_DECLARE,         // slot     unset a local, becomes OP_BOX if captured
+    OP_BOX,             // slot     put a new, unbound box in a local
+    OP_GET_UPVALUE,     // index    push a variable captured by the closure
+    OP_GET_GLOBAL,      // k        push the value in cells[k]
+    OP_GET_CALLEE,      // k        as OP_GET_GLOBAL, for the operator of a
+                        //          call, expanding the call if it's a macro
+    OP_CHECK_CALLEE,    //          expand the call if the operator on top,
+                        //          from a local or upvalue, is a macro
+    OP_EXPANDED,        // site     run the expansion of callSites[site]
+    OP_DEF_GLOBAL,      // k        set cells[k], leaving the value
+    OP_MACRO,           //          turn the lambda on top into a macro
+    OP_JUMP,            // offset   jump forwards
+    OP_JUMP_IF_FALSE,   // offset   pop, and jump forwards if false or nil
+    OP_CALL,            // argc     call, with op and args on the stack
+    OP_TAIL_CALL,       // argc     as OP_CALL, replacing the current frame
+    OP_RETURN,          //          return the top of the stack
+    OP_CLOSURE,         // k        push a closure over protos[k]
+    OP_VECTOR,          // n        replace n items with a vector
+    OP_HASH,            // n        replace n keys and values with a hash
+    OP_TRY,             // offset offset
+                        //          install a handler, with the offsets of
+                        //          the catch* code and the end of the try*
+    OP_END_TRY,         // offset   remove the handler and skip the catch*
+    OP_MACROEXPAND,     // k        push the expansion of constants[k]
+    OP_THROW,           // k        throw constants[k] as an error message
+    OP_THROW_VALUE,     // k        throw constants[k]
+};
+
+class vmLocal;
+typedef RefCountedPtr<vmLocal> vmLocalPtr;
+
+// The compiler's record of a local variable.
+class vmLocal : public RefCounted {
+public:
+    vmLocal(SymbolId id, int slot, vmLocalPtr outer)
+    : id(id), slot(slot), isCaptured(false), isPending(true), outer(outer) { }
+
+    const SymbolId   id;
+    const int        slot;
+    bool             isCaptured;    // if so, the slot holds a box
+    bool             isPending;     // still compiling the initial value
+    const vmLocalPtr outer;         // the local declared before this one
+};
+
+// Calls keep enough information to expand their form if the operator turns
+// out to be a macro that was defined after the call was compiled. The
+// expansion is compiled as a lambda over the visible locals and upvalues.
+// For a global operator this happens once, the first time the call is run
+// with a macro, and the OP_GET_CALLEE is patched to an OP_EXPANDED which
+// calls it. An operator in a local or upvalue may be a macro on one call and
+// not the next, so OP_CHECK_CALLEE expands the call each time it is one.
+struct vmCallSite {
+    int                     offset;     // of the OP_GET_CALLEE or
+                                        // OP_CHECK_CALLEE
+    int                     end;        // just past the call instruction
+    malValuePtr             form;
+    std::vector<vmLocalPtr> locals;     // visible at the call
+    int                     blockLocals;    // how many of those are in the
+                                            // innermost block
+    malValuePtr             expansion;
+    std::vector<int>        upvalues;   // passed to the expansion
+};
+
+// A binding that a local or upvalue shadows: a local of the same function,
+// or else one of the closure's upvalues.
+struct vmShadowed {
+    vmLocalPtr  local;
+    int         upvalue;
+};
+
+// Records which variable an instruction reads, for error messages. Until
+// it's set, which may be by a def! that hasn't run yet, the variable reads
+// as the first binding it shadows that is set, or else as the global.
+struct vmVarName {
+    int                     offset;
+    SymbolId                id;
+    std::vector<vmShadowed> shadowed;   // innermost first
+};
+
+struct vmUpvalue {
+    SymbolId    id;
+    bool        isLocal;    // captured from the enclosing function's slots
+    int         index;      // ... or from its upvalues
+};
+
+class vmProto;
+typedef RefCountedPtr<vmProto> vmProtoPtr;
+
+class vmProto : public RefCounted {
+public:
+    vmProto() : arity(0), isVariadic(false), slotCount(0), stackSize(0) { }
+
+    std::vector<uint8_t>    code;
+    malValueVec             constants;
+    std::vector<malCellPtr> cells;          // of the globals used
+    std::vector<vmProtoPtr> protos;         // of the fn* forms within
+    std::vector<vmUpvalue>  upvalues;
+    std::vector<int>        boxedParams;
+    std::vector<int>        sharedParams;   // of an expansion, passed in boxes
+    std::vector<vmCallSite> callSites;
+    std::vector<vmVarName>  varNames;
+    SymbolIdVec             params;
+    malValuePtr             body;
+    int                     arity;          // not counting a & parameter
+    bool                    isVariadic;
+    int                     slotCount;      // parameters and locals
+    int                     stackSize;      // slots plus operands
+
+    int findCallSite(int offset) const;
+    const vmVarName& findVarName(int offset) const;
+};
+
+// The code for a lambda created by the VM, which carries the boxes of the
+// variables it has captured.
+class vmClosure : public malCode {
+public:
+    vmClosure(vmProtoPtr proto, malEnvPtr env)
+    : malCode(MAL_CODE_VM), proto(proto), env(env) {
+        setMayCycle();
+    }
+
+    virtual malValuePtr apply(const malLambda* lambda,
+                              malValueIter argsBegin,
+                              malValueIter argsEnd) const;
+
+    virtual void traceRefs(malTracer& tracer) const;
+
+    const vmProtoPtr proto;
+    const malEnvPtr  env;           // where globals are looked up
+    malValueVec      upvalues;
+};
+
+// Compiles ast as the body of a function of no arguments.
+extern vmProtoPtr vmCompile(malValuePtr ast, malEnvPtr env);
+
+// Compiles ast as the body of a function whose parameters are the given
+// variables, so that it can be run outside of the scope it came from. The
+// first sharedCount parameters are from the caller's innermost block, where
+// a def! would define a variable, so those that it def!s are shared: they're
+// passed in boxes, so that the caller sees the change.
+extern vmProtoPtr vmCompileLifted(malValuePtr ast, const SymbolIdVec& params,
+                                  int sharedCount, malEnvPtr env);
+
+#endif // INCLUDE_VM_H
@@ -0,0 +1,134 @@
+#ifndef INCLUDE_VALUEPTR_H
+#define INCLUDE_VALUEPTR_H
+
+#include "RefCountedPtr.h"
+
+#include <stdint.h>
+
+// Every value is tagged with its concrete type when it's constructed, so
+// that casts and type tests are a compare rather than an RTTI lookup.
+enum malType {
+    MAL_CONSTANT,
+    MAL_INTEGER,
+    MAL_STRING,
+    MAL_KEYWORD,
+    MAL_SYMBOL,
+    MAL_LIST,
+    MAL_VECTOR,
+    MAL_HASH,
+    MAL_BUILTIN,
+    MAL_LAMBDA,
+    MAL_ATOM,
+    MAL_TRANSIENT,
+};
+
+class malValue;
+class malValueArrow;
+
+// A counted reference to a value. Integers which fit in 63 bits, and the
+// constants nil, true and false, are encoded in the word itself, so making,
+// copying and dropping them never touches the heap or a refcount:
+//
+//      ...xxx1     an integer, in the upper 63 bits
+//      ...x010     a constant: nil, true or false
+//      ...x000     a malValue*, or NULL
+//
+// Immediates can still be used through ->, which sees the shared malConstant
+// objects, or a temporary malInteger. The hot paths avoid this by using
+// type(), isTrue(), intValue(), isEqualTo() and hash() on the reference
+// itself.
+// The members which need the complete value types are in Types.h.
+class malValuePtr {
+public:
+    enum Constant { CONST_NIL, CONST_TRUE, CONST_FALSE, CONSTANT_COUNT };
+
+    malValuePtr() : m_word(0) { }
+    inline malValuePtr(malValue* object);
+    inline malValuePtr(const malValuePtr& rhs);
+    inline ~malValuePtr();
+
+    // Moving takes over the count of rhs, and leaves it NULL.
+    malValuePtr(malValuePtr&& rhs) : m_word(rhs.m_word) { rhs.m_word = 0; }
+
+    inline const malValuePtr& operator = (const malValuePtr& rhs);
+    inline const malValuePtr& operator = (malValuePtr&& rhs);
+
+    static malValuePtr constant(Constant which) {
+        return malValuePtr((uintptr_t(which) << 3) | CONSTANT_TAG);
+    }
+
+    static bool fitsInteger(int64_t value) {
+        return (value >= MIN_INTEGER) && (value <= MAX_INTEGER);
+    }
+
+    static malValuePtr integer(int64_t value) {
+        return malValuePtr((uintptr_t(value) << 1) | INTEGER_TAG);
+    }
+
+    bool operator == (const malValuePtr& rhs) const {
+        return m_word == rhs.m_word;
+    }
+
+    bool operator != (const malValuePtr& rhs) const {
+        return m_word != rhs.m_word;
+    }
+
+    operator bool () const {
+        return m_word != 0;
+    }
+
+    bool isImmediate() const { return (m_word & IMMEDIATE_MASK) != 0; }
+    bool isTrue() const {
+        return (m_word != constant(CONST_NIL).m_word)
+            && (m_word != constant(CONST_FALSE).m_word);
+    }
+
+    inline malType type() const;
+    inline int64_t intValue() const;
+    bool isEqualTo(const malValuePtr& rhs) const;
+    inline size_t hash() const;
+    inline bool mayCycle() const;
+
+    inline malValueArrow operator -> () const;
+    inline malValue* ptr() const;
+
+private:
+    static const uintptr_t INTEGER_TAG    = 1;
+    static const uintptr_t CONSTANT_TAG   = 2;
+    static const uintptr_t IMMEDIATE_MASK = 7;
+    static const int64_t   MAX_INTEGER    = INT64_MAX >> 1;
+    static const int64_t   MIN_INTEGER    = INT64_MIN >> 1;
+
+    explicit malValuePtr(uintptr_t word) : m_word(word) { }
+
+    malValue* object() const { return reinterpret_cast<malValue*>(m_word); }
+
+    static malValue* constantObject(uintptr_t word);
+    static malValuePtr boxInteger(int64_t value);
+
+    inline void acquire() const;
+    static inline void release(uintptr_t word);
+
+    uintptr_t m_word;
+
+    friend class malValueArrow;
+};
+
+// What -> returns: usually just the object, but an immediate integer is
+// boxed, and the box kept alive until the end of the full expression.
+class malValueArrow {
+public:
+    malValue* operator -> () const { return m_object; }
+
+private:
+    malValueArrow(malValue* object) : m_object(object) { }
+    malValueArrow(const malValuePtr& box)
+        : m_object(box.object()), m_box(box) { }
+
+    malValue*   m_object;
+    malValuePtr m_box;
+
+    friend class malValuePtr;
+};
+
+#endif // INCLUDE_VALUEPTR_H
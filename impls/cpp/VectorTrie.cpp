@@ -0,0 +1,166 @@
+#include "VectorTrie.h"
+#include "Collector.h"
+#include "Types.h"
+
+#include <algorithm>
+
+static const int BITS  = malTrieNode::BITS;
+static const int WIDTH = malTrieNode::WIDTH;
+static const int MASK  = malTrieNode::MASK;
+
+// Gets a node that can be changed without anyone else seeing: the node
+// itself if this is the only reference to it, otherwise a copy, which
+// replaces it. A missing node is created empty.
+template<class Node>
+static Node* editable(malTrieNodePtr& node)
+{
+    if (!node) {
+        node = new Node;
+    }
+    else if (node->refCount() != 1) {
+        const Node* original = static_cast<const Node*>(node.ptr());
+        Node* copy = new Node;
+        std::copy(original->slots, original->slots + WIDTH, copy->slots);
+        if (original->mayCycle()) {
+            copy->setMayCycle();
+        }
+        node = copy;
+    }
+    return static_cast<Node*>(node.ptr());
+}
+
+static void appendNode(const malTrieNode* node, int level,
+                       malValueVec& items)
+{
+    if (level == 0) {
+        const malTrieLeaf* leaf = static_cast<const malTrieLeaf*>(node);
+        items.insert(items.end(), leaf->slots, leaf->slots + WIDTH);
+        return;
+    }
+    const malTrieBranch* branch = static_cast<const malTrieBranch*>(node);
+    for (int i = 0; i < WIDTH && branch->slots[i]; i++) {
+        appendNode(branch->slots[i].ptr(), level - BITS, items);
+    }
+}
+
+malVectorTrie::malVectorTrie(malValueIter begin, malValueIter end)
+: m_count(0)
+, m_shift(BITS)
+{
+    for (auto it = begin; it != end; ++it) {
+        push(*it);
+    }
+}
+
+const malValuePtr& malVectorTrie::item(int index) const
+{
+    if (index >= tailOffset()) {
+        return static_cast<const malTrieLeaf*>(m_tail.ptr())
+            ->slots[index & MASK];
+    }
+    const malTrieNode* node = m_root.ptr();
+    for (int level = m_shift; level > 0; level -= BITS) {
+        node = static_cast<const malTrieBranch*>(node)
+            ->slots[(index >> level) & MASK].ptr();
+    }
+    return static_cast<const malTrieLeaf*>(node)->slots[index & MASK];
+}
+
+void malVectorTrie::push(malValuePtr value)
+{
+    int tailCount = m_count - tailOffset();
+    if (tailCount < WIDTH) {
+        malTrieLeaf* tail = editable<malTrieLeaf>(m_tail);
+        if (value.mayCycle()) {
+            tail->setMayCycle();
+        }
+        tail->slots[tailCount] = std::move(value);
+        m_count++;
+        return;
+    }
+
+    // The tail is full, so it goes into the tree, which first grows a
+    // level if it's full too.
+    if ((m_count >> BITS) > (1 << m_shift)) {
+        malTrieBranch* root = new malTrieBranch;
+        if (m_root->mayCycle()) {
+            root->setMayCycle();
+        }
+        root->slots[0] = std::move(m_root);
+        m_root = root;
+        m_shift += BITS;
+    }
+    leafSlot(m_count - 1, m_tail->mayCycle()) = std::move(m_tail);
+
+    malTrieLeaf* tail = new malTrieLeaf;
+    if (value.mayCycle()) {
+        tail->setMayCycle();
+    }
+    tail->slots[0] = std::move(value);
+    m_tail = tail;
+    m_count++;
+}
+
+void malVectorTrie::set(int index, malValuePtr value)
+{
+    bool mayCycle = value.mayCycle();
+    malTrieNodePtr& slot = (index >= tailOffset())
+        ? m_tail : leafSlot(index, mayCycle);
+    malTrieLeaf* leaf = editable<malTrieLeaf>(slot);
+    if (mayCycle) {
+        leaf->setMayCycle();
+    }
+    leaf->slots[index & MASK] = std::move(value);
+}
+
+// The slot in the tree which holds the leaf for an index. The branches on
+// the way are made editable, or created if they're missing, and marked if
+// the leaf may be part of a cycle.
+malTrieNodePtr& malVectorTrie::leafSlot(int index, bool mayCycle)
+{
+    malTrieNodePtr* node = &m_root;
+    for (int level = m_shift; level > 0; level -= BITS) {
+        malTrieBranch* branch = editable<malTrieBranch>(*node);
+        if (mayCycle) {
+            branch->setMayCycle();
+        }
+        node = &branch->slots[(index >> level) & MASK];
+    }
+    return *node;
+}
+
+void malVectorTrie::appendTo(malValueVec& items) const
+{
+    items.reserve(items.size() + m_count);
+    if (m_root) {
+        appendNode(m_root.ptr(), m_shift, items);
+    }
+    if (m_tail) {
+        const malTrieLeaf* tail = static_cast<const malTrieLeaf*>(m_tail.ptr());
+        items.insert(items.end(), tail->slots,
+                     tail->slots + m_count - tailOffset());
+    }
+}
+
+bool malVectorTrie::mayCycle() const
+{
+    return (m_root && m_root->mayCycle()) || (m_tail && m_tail->mayCycle());
+}
+
+void malVectorTrie::traceRefs(malTracer& tracer) const
+{
+    tracer(m_root);
+    tracer(m_tail);
+}
+
+void malTrieBranch::traceRefs(malTracer& tracer) const
+{
+    for (int i = 0; i < WIDTH; i++) {
+        tracer(slots[i]);
+    }
+}
+
+void malTrieLeaf::traceRefs(malTracer& tracer) const
+{
+    tracer(slots, slots + WIDTH);
+}
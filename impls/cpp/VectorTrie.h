@@ -0,0 +1,71 @@
+#ifndef INCLUDE_VECTORTRIE_H
+#define INCLUDE_VECTORTRIE_H
+
+#include "MAL.h"
+
+// The items of a large vector, in a persistent trie: a tree of nodes 32
+// wide, with the last (up to) 32 items kept aside in a tail node. Appending
+// copies just the tail until it fills, and then moves it into the tree,
+// copying only the nodes on its path. Lookups and updates are O(log32 n),
+// and a changed copy shares every node it didn't change.
+//
+// A node that nothing else refers to is changed in place, so building a
+// trie up one item at a time doesn't copy the tail on every push. A node
+// on the path to an item that can be part of a cycle is marked as one that
+// can be too, for the cycle collector.
+class malTrieNode : public RefCounted {
+public:
+    POOL_ALLOCATED
+
+    static const int BITS  = 5;
+    static const int WIDTH = 1 << BITS;
+    static const int MASK  = WIDTH - 1;
+};
+
+typedef RefCountedPtr<malTrieNode> malTrieNodePtr;
+
+class malTrieBranch : public malTrieNode {
+public:
+    virtual void traceRefs(malTracer& tracer) const;
+
+    malTrieNodePtr slots[WIDTH];
+};
+
+class malTrieLeaf : public malTrieNode {
+public:
+    virtual void traceRefs(malTracer& tracer) const;
+
+    malValuePtr slots[WIDTH];
+};
+
+class malVectorTrie {
+public:
+    malVectorTrie() : m_count(0), m_shift(malTrieNode::BITS) { }
+    malVectorTrie(malValueIter begin, malValueIter end);
+
+    int count() const { return m_count; }
+    const malValuePtr& item(int index) const;
+
+    void push(malValuePtr value);
+    void set(int index, malValuePtr value);
+
+    void appendTo(malValueVec& items) const;
+
+    bool mayCycle() const;
+    void traceRefs(malTracer& tracer) const;
+
+private:
+    int tailOffset() const {
+        return m_count < malTrieNode::WIDTH
+            ? 0 : ((m_count - 1) >> malTrieNode::BITS) << malTrieNode::BITS;
+    }
+
+    malTrieNodePtr& leafSlot(int index, bool mayCycle);
+
+    malTrieNodePtr  m_root;   // a branch, NULL until the tail first fills
+    malTrieNodePtr  m_tail;   // a leaf
+    int             m_count;
+    int             m_shift;  // the bits of an index below the root's slots
+};
+
+#endif // INCLUDE_VECTORTRIE_H
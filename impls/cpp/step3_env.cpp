@@ -85,7 +85,7 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
     // Now we're left with the case of a regular list to be evaluated.
     std::unique_ptr<malValueVec> items(list->evalItems(env));
     malValuePtr op = items->at(0);
-    return APPLY(op, items->begin()+1, items->end());
+    return APPLY(op, items->data()+1, items->data()+items->size());
 }
 
 String PRINT(malValuePtr ast)
@@ -93,7 +93,7 @@ String PRINT(malValuePtr ast)
     return ast->print(true);
 }
 
-malValuePtr APPLY(malValuePtr op, malValueIter argsBegin, malValueIter argsEnd)
+malValuePtr APPLY(const malValuePtr& op, malValueIter argsBegin, malValueIter argsEnd)
 {
     const malApplicable* handler = DYNAMIC_CAST(malApplicable, op);
     MAL_CHECK(handler != NULL,
@@ -96,7 +96,7 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
         if (special == "if") {
             checkArgsBetween("if", 2, 3, argCount);
 
-            bool isTrue = EVAL(list->item(1), env)->isTrue();
+            bool isTrue = EVAL(list->item(1), env).isTrue();
             if (!isTrue && (argCount == 2)) {
                 return mal::nilValue();
             }
@@ -123,10 +123,10 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
     malValuePtr op = items->at(0);
     if (const malLambda* lambda = DYNAMIC_CAST(malLambda, op)) {
         return EVAL(lambda->getBody(),
-                    lambda->makeEnv(items->begin()+1, items->end()));
+                    lambda->makeEnv(items->data()+1, items->data()+items->size()));
     }
     else {
-        return APPLY(op, items->begin()+1, items->end());
+        return APPLY(op, items->data()+1, items->data()+items->size());
     }
 }
 
@@ -135,7 +135,7 @@ String PRINT(malValuePtr ast)
     return ast->print(true);
 }
 
-malValuePtr APPLY(malValuePtr op, malValueIter argsBegin, malValueIter argsEnd)
+malValuePtr APPLY(const malValuePtr& op, malValueIter argsBegin, malValueIter argsEnd)
 {
     const malApplicable* handler = DYNAMIC_CAST(malApplicable, op);
     MAL_CHECK(handler != NULL,
@@ -1,9 +1,14 @@
 #include "MAL.h"
 
+#include "Collector.h"
 #include "Environment.h"
+#include "FreeQueue.h"
 #include "ReadLine.h"
 #include "Types.h"
+#include "VM.h"
 
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 #include <memory>
 
@@ -14,17 +19,77 @@ static void installFunctions(malEnvPtr env);
 
 static void makeArgv(malEnvPtr env, int argc, char* argv[]);
 static String safeRep(const String& input, malEnvPtr env);
-static malValuePtr quasiquote(malValuePtr obj);
-static malValuePtr macroExpand(malValuePtr obj, malEnvPtr env);
+
+static bool isSymbol(malValuePtr obj, SymbolId id);
+
+class malNode;
+class malScope;
+
+// Special forms are analysed by handlers in a table indexed by symbol id.
+typedef RefCountedPtr<malNode> (SpecialForm)(const malList* list,
+                                  const RefCountedPtr<malScope>& scope);
+static std::vector<SpecialForm*> s_specialForms;
+static void installSpecialForms();
+static SpecialForm* specialForm(SymbolId id);
+
+static const SymbolId s_ampersandId       = internSymbol("&");
+static const SymbolId s_catchId           = internSymbol("catch*");
+static const SymbolId s_concatId          = internSymbol("concat");
+static const SymbolId s_consId            = internSymbol("cons");
+static const SymbolId s_doId              = internSymbol("do");
+static const SymbolId s_quoteId           = internSymbol("quote");
+static const SymbolId s_spliceUnquoteId   = internSymbol("splice-unquote");
+static const SymbolId s_unquoteId         = internSymbol("unquote");
+static const SymbolId s_vecId             = internSymbol("vec");
 
 static ReadLine s_readLine("~/.mal-history");
 
 static malEnvPtr replEnv(new malEnv);
 
+// Set MAL_ENGINE=vm in the environment to run code with the bytecode VM
+// rather than the tree-walking evaluator.
+static bool s_useVM = false;
+
+#if DEBUG_REFCOUNT_OPS
+static void reportRefCountOps()
+{
+    TRACE("%llu refcount operations\n", refCountOps());
+}
+#endif
+
+static void reportPools()
+{
+    malPool::report(stderr);
+}
+
+static void reportCollector()
+{
+    malCollector::report(stderr);
+}
+
 int main(int argc, char* argv[])
 {
     String prompt = "user> ";
     String input;
+#if DEBUG_REFCOUNT_OPS
+    atexit(reportRefCountOps);
+#endif
+    // Set MAL_POOL_STATS to see how the pools did, in a POOL=1 build.
+    if (getenv("MAL_POOL_STATS") != NULL) {
+        atexit(reportPools);
+    }
+    // And MAL_GC_STATS to see what the cycle collector found.
+    if (getenv("MAL_GC_STATS") != NULL) {
+        atexit(reportCollector);
+    }
+    // Set MAL_FREE_SLICE to free at most that many objects at a time.
+    if (const char* slice = getenv("MAL_FREE_SLICE")) {
+        malFreeQueue::setSliceSize(atoi(slice));
+    }
+    const char* engine = getenv("MAL_ENGINE");
+    s_useVM = (engine != NULL) && (strcmp(engine, "vm") == 0);
+    replEnv->makeImmortal();
+    installSpecialForms();
     installCore(replEnv);
     installFunctions(replEnv);
     makeArgv(replEnv, argc - 2, argv + 2);
@@ -36,6 +101,8 @@ int main(int argc, char* argv[])
     rep("(println (str \"Mal [\" *host-language* \"]\"))", replEnv);
     while (s_readLine.get(prompt, input)) {
         String out = safeRep(input, replEnv);
+        malCollector::collectIfDue();
+        malFreeQueue::drain(malFreeQueue::sliceSize());
         if (out.length() > 0)
             std::cout << out << "\n";
     }
@@ -77,176 +144,909 @@ malValuePtr READ(const String& input)
     return readStr(input);
 }
 
-malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
+// EVAL doesn't walk the AST directly. Each form is first analysed into a
+// tree of malNodes, with special forms recognised, arguments checked and
+// macros expanded once, and then that tree is run. The analysed body of a
+// fn* is kept with the lambdas it creates, so calls go straight to it.
+//
+// A macro call is expanded when it is analysed, using the macro defined at
+// that point. If the operator only becomes a macro later on, the call is
+// expanded the first time it runs as one. Either way the expansion is kept,
+// so redefining a macro affects code analysed afterwards, but not code
+// which has already been expanded. The exception is a macro passed in a
+// local variable, which is expanded each time the call runs with one.
+//
+// A late expansion can def! new locals, which the symbols analysed before
+// it didn't know about. Those are resolved again before they're next read.
+
+class malScope;
+typedef RefCountedPtr<malScope> malScopePtr;
+
+class malNode;
+typedef RefCountedPtr<malNode> malNodePtr;
+typedef std::vector<malNodePtr> malNodeVec;
+
+// Records the variables bound by the enclosing fn*, let* and catch* forms
+// while analysing. Each scope becomes a frame when the code is run, with
+// its variables in numbered slots, so references to them are resolved to a
+// frame depth and slot up front. Anything else is a global.
+class malScope : public RefCounted {
+public:
+    malScope(malScopePtr outer, bool isFunction)
+    : m_outer(outer), m_isFunction(isFunction) { }
+
+    // A declared variable is pending until its value has been analysed.
+    // References to it from its own initialiser see the binding outside
+    // instead, except within a fn*, which will run once it's defined.
+    int declare(SymbolId id);
+    void define(int slot) { m_isPending[slot] = false; }
+    int bind(SymbolId id);
+
+    bool isBound(SymbolId id) const;
+    bool resolve(SymbolId id, bool withPending, int& depth, int& slot) const;
+    bool resolveNext(SymbolId id, bool withPending,
+                     int& depth, int& slot) const;
+    int slotOf(SymbolId id) const;
+    int size() const { return m_names.size(); }
+
+private:
+    const malScopePtr m_outer;
+    const bool        m_isFunction;
+    SymbolIdVec       m_names;
+    std::vector<bool> m_isPending;
+};
+
+int malScope::declare(SymbolId id)
 {
-    if (!env) {
-        env = replEnv;
+    m_names.push_back(id);
+    m_isPending.push_back(true);
+    return m_names.size() - 1;
+}
+
+int malScope::bind(SymbolId id)
+{
+    int slot = declare(id);
+    define(slot);
+    return slot;
+}
+
+bool malScope::isBound(SymbolId id) const
+{
+    int depth, slot;
+    return resolve(id, true, depth, slot);
+}
+
+bool malScope::resolve(SymbolId id, bool withPending,
+                       int& depth, int& slot) const
+{
+    depth = 0;
+    slot = m_names.size();
+    return resolveNext(id, withPending, depth, slot);
+}
+
+// Carries on from a binding found by resolve to the one that it shadows.
+bool malScope::resolveNext(SymbolId id, bool withPending,
+                           int& depth, int& slot) const
+{
+    const malScope* scope = this;
+    for (int i = 0; i < depth; i++) {
+        withPending = withPending || scope->m_isFunction;
+        scope = scope->m_outer.ptr();
     }
-    while (1) {
-        const malList* list = DYNAMIC_CAST(malList, ast);
-        if (!list || (list->count() == 0)) {
-            return ast->eval(env);
+    while (scope) {
+        for (int i = slot - 1; i >= 0; i--) {
+            if ((scope->m_names[i] == id) &&
+                (withPending || !scope->m_isPending[i])) {
+                slot = i;
+                return true;
+            }
         }
+        withPending = withPending || scope->m_isFunction;
+        scope = scope->m_outer.ptr();
+        depth++;
+        slot = scope ? scope->m_names.size() : 0;
+    }
+    return false;
+}
 
-        ast = macroExpand(ast, env);
-        list = DYNAMIC_CAST(malList, ast);
-        if (!list || (list->count() == 0)) {
-            return ast->eval(env);
+int malScope::slotOf(SymbolId id) const
+{
+    for (int i = m_names.size() - 1; i >= 0; i--) {
+        if (m_names[i] == id) {
+            return i;
         }
+    }
+    return -1;
+}
 
-        // From here on down we are evaluating a non-empty list.
-        // First handle the special forms.
-        if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, list->item(0))) {
-            String special = symbol->value();
-            int argCount = list->count() - 1;
+class malNode : public RefCounted {
+public:
+    // Evaluates the node in env. A node in tail position can instead hand
+    // evaluation on to another node by setting next (and nextEnv, if that
+    // runs in a new environment), in which case the value returned is
+    // ignored. This is how TCO is kept. Setting nextEnv must be the last
+    // thing a node does, as it may release env.
+    virtual malValuePtr exec(malEnvRef env, malEnvPtr& nextEnv,
+                             malNodePtr& next) const = 0;
 
-            if (special == "def!") {
-                checkArgsIs("def!", 2, argCount);
-                const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
-                return env->set(id->value(), EVAL(list->item(2), env));
-            }
+    malValuePtr run(malEnvRef env) const;
+};
 
-            if (special == "defmacro!") {
-                checkArgsIs("defmacro!", 2, argCount);
+malValuePtr malNode::run(malEnvRef env) const
+{
+    // The caller keeps env alive, so it's only counted here once a node
+    // moves on to a new environment.
+    const malNode* node = this;
+    malEnvPtr frame;
+    malNodePtr current, next;
+    while (1) {
+        malValuePtr value = node->exec(env, frame, next);
+        if (!next) {
+            return value;
+        }
+        if (frame) {
+            env = frame;
+            malCollector::collectIfDue();
+        }
+        current = std::move(next);
+        node = current.ptr();
+    }
+}
 
-                const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
-                malValuePtr body = EVAL(list->item(2), env);
-                const malLambda* lambda = VALUE_CAST(malLambda, body);
-                return env->set(id->value(), mal::macro(*lambda));
-            }
+static malValueVec* runNodes(const malNodeVec& nodes, malEnvRef env)
+{
+    std::unique_ptr<malValueVec> items(new malValueVec);
+    items->reserve(nodes.size());
+    for (auto it = nodes.begin(), end = nodes.end(); it != end; ++it) {
+        items->push_back((*it)->run(env));
+    }
+    return items.release();
+}
 
-            if (special == "do") {
-                checkArgsAtLeast("do", 1, argCount);
+static malNodePtr analyze(malValuePtr ast, const malScopePtr& scope);
+static malNodePtr analyzeLocal(SymbolId id, const malScopePtr& scope,
+                               int depth, int slot);
+static malNodePtr expandMacro(malValuePtr macro, malValuePtr ast,
+                              const malScopePtr& scope);
 
-                for (int i = 1; i < argCount; i++) {
-                    EVAL(list->item(i), env);
-                }
-                ast = list->item(argCount);
-                continue; // TCO
-            }
+// Counts the late expansions which have declared new locals, so that symbol
+// nodes can tell when to resolve themselves again.
+static int s_lateLocals = 0;
 
-            if (special == "fn*") {
-                checkArgsIs("fn*", 2, argCount);
+class malConstantNode : public malNode {
+public:
+    malConstantNode(malValuePtr value) : m_value(value) { }
 
-                const malSequence* bindings =
-                    VALUE_CAST(malSequence, list->item(1));
-                StringVec params;
-                for (int i = 0; i < bindings->count(); i++) {
-                    const malSymbol* sym =
-                        VALUE_CAST(malSymbol, bindings->item(i));
-                    params.push_back(sym->value());
-                }
+    virtual malValuePtr exec(malEnvRef env, malEnvPtr& nextEnv,
+                             malNodePtr& next) const {
+        return m_value;
+    }
 
-                return mal::lambda(params, list->item(2), env);
-            }
+private:
+    const malValuePtr m_value;
+};
 
-            if (special == "if") {
-                checkArgsBetween("if", 2, 3, argCount);
+// A global variable, read through its cell, unless a local of the same name
+// has since been declared by a late expansion.
+class malSymbolNode : public malNode {
+public:
+    malSymbolNode(const malCellPtr& cell, const malScopePtr& scope)
+    : m_cell(cell), m_scope(scope), m_lateLocals(s_lateLocals) { }
 
-                bool isTrue = EVAL(list->item(1), env)->isTrue();
-                if (!isTrue && (argCount == 2)) {
-                    return mal::nilValue();
-                }
-                ast = list->item(isTrue ? 2 : 3);
-                continue; // TCO
+    virtual malValuePtr exec(malEnvRef env, malEnvPtr& nextEnv,
+                             malNodePtr& next) const {
+        if (m_lateLocals != s_lateLocals) {
+            m_lateLocals = s_lateLocals;
+            int depth, slot;
+            if (m_scope && m_scope->resolve(m_cell->id(), false, depth, slot)) {
+                m_local = analyzeLocal(m_cell->id(), m_scope, depth, slot);
             }
+        }
+        if (m_local) {
+            return m_local->exec(env, nextEnv, next);
+        }
+        const malValuePtr& value = m_cell->value();
+        MAL_CHECK(value, "'%s' not found", symbolName(m_cell->id()).c_str());
+        return value;
+    }
 
-            if (special == "let*") {
-                checkArgsIs("let*", 2, argCount);
-                const malSequence* bindings =
-                    VALUE_CAST(malSequence, list->item(1));
-                int count = checkArgsEven("let*", bindings->count());
-                malEnvPtr inner(new malEnv(env));
-                for (int i = 0; i < count; i += 2) {
-                    const malSymbol* var =
-                        VALUE_CAST(malSymbol, bindings->item(i));
-                    inner->set(var->value(), EVAL(bindings->item(i+1), inner));
-                }
-                ast = list->item(2);
-                env = inner;
-                continue; // TCO
-            }
+private:
+    const malCellPtr   m_cell;
+    const malScopePtr  m_scope;
+    mutable int        m_lateLocals;
+    mutable malNodePtr m_local;
+};
 
-            if (special == "macroexpand") {
-                checkArgsIs("macroexpand", 1, argCount);
-                return macroExpand(list->item(1), env);
-            }
+// A local variable, read from its slot in the frame at depth. It may be
+// defined by a def! which hasn't run yet, in which case it reads as the
+// binding that it shadows, if there is one, or else as the global.
+class malLocalNode : public malNode {
+public:
+    malLocalNode(SymbolId id, const malScopePtr& scope, int depth, int slot,
+                 malNodePtr shadowed)
+    : m_id(id), m_scope(scope), m_depth(depth), m_slot(slot)
+    , m_shadowed(shadowed), m_lateLocals(s_lateLocals) { }
+
+    virtual malValuePtr exec(malEnvRef env, malEnvPtr& nextEnv,
+                             malNodePtr& next) const {
+        if (m_lateLocals != s_lateLocals) {
+            // A late expansion may have declared a local which shadows
+            // this one.
+            m_lateLocals = s_lateLocals;
+            int depth, slot;
+            m_scope->resolve(m_id, false, depth, slot);
+            m_rebound = (depth != m_depth || slot != m_slot)
+                ? analyzeLocal(m_id, m_scope, depth, slot) : malNodePtr();
+        }
+        if (m_rebound) {
+            return m_rebound->exec(env, nextEnv, next);
+        }
+        malEnv* frame = env.ptr();
+        for (int i = 0; i < m_depth; i++) {
+            frame = frame->outer();
+        }
+        const malValuePtr& value = frame->getSlot(m_slot);
+        if (value) {
+            return value;
+        }
+        return m_shadowed ? m_shadowed->run(env) : env->get(m_id);
+    }
+
+private:
+    const SymbolId     m_id;
+    const malScopePtr  m_scope;
+    const int          m_depth;
+    const int          m_slot;
+    const malNodePtr   m_shadowed;
+    mutable int        m_lateLocals;
+    mutable malNodePtr m_rebound;
+};
+
+class malVectorNode : public malNode {
+public:
+    malVectorNode(const malNodeVec& items) : m_items(items) { }
+
+    virtual malValuePtr exec(malEnvRef env, malEnvPtr& nextEnv,
+                             malNodePtr& next) const {
+        return mal::vector(runNodes(m_items, env));
+    }
+
+private:
+    const malNodeVec m_items;
+};
+
+class malHashNode : public malNode {
+public:
+    // Keys and values alternate in items, as for the hash-map builtin.
+    malHashNode(const malNodeVec& items) : m_items(items) { }
+
+    virtual malValuePtr exec(malEnvRef env, malEnvPtr& nextEnv,
+                             malNodePtr& next) const {
+        std::unique_ptr<malValueVec> items(runNodes(m_items, env));
+        return mal::hash(items->data(), items->data() + items->size(), true);
+    }
+
+private:
+    const malNodeVec m_items;
+};
+
+// The code of a lambda created by fn*. Its body runs in a new frame, which
+// holds the arguments in the first slots.
+class malFnCode : public malCode {
+public:
+    malFnCode(const malScopePtr& scope, int arity, bool isVariadic,
+              malNodePtr body)
+    : malCode(MAL_CODE_NODES), m_scope(scope), m_arity(arity)
+    , m_isVariadic(isVariadic), m_body(body) { }
+
+    virtual malValuePtr apply(const malLambda* lambda,
+                              malValueIter argsBegin,
+                              malValueIter argsEnd) const {
+        return m_body->run(makeEnv(lambda, argsBegin, argsEnd));
+    }
+
+    malEnvPtr makeEnv(const malLambda* lambda,
+                      malValueIter argsBegin, malValueIter argsEnd) const;
+
+    // As makeEnv, but runs the argument nodes in env straight into the
+    // slots of the new frame. Returns NULL if they don't fit the parameters
+    // exactly, leaving the caller to go the long way round.
+    malEnvPtr runArgs(const malLambda* lambda,
+                      const malNodeVec& args, malEnvRef env) const;
+
+    const malNodePtr& body() const { return m_body; }
+
+private:
+    const malScopePtr m_scope;
+    const int         m_arity;
+    const bool        m_isVariadic;
+    const malNodePtr  m_body;
+};
+
+malEnvPtr malFnCode::makeEnv(const malLambda* lambda,
+                             malValueIter argsBegin,
+                             malValueIter argsEnd) const
+{
+    int argCount = std::distance(argsBegin, argsEnd);
+    MAL_CHECK(argCount >= m_arity, "Not enough parameters");
+    MAL_CHECK(m_isVariadic || (argCount == m_arity), "Too many parameters");
+
+    malEnvPtr env(new malEnv(lambda->getEnv(), m_scope->size()));
+    for (int i = 0; i < m_arity; i++, ++argsBegin) {
+        env->setSlot(i, *argsBegin);
+    }
+    if (m_isVariadic) {
+        env->setSlot(m_arity, mal::list(argsBegin, argsEnd));
+    }
+    return env;
+}
+
+malEnvPtr malFnCode::runArgs(const malLambda* lambda,
+                             const malNodeVec& args, malEnvRef env) const
+{
+    if (m_isVariadic || ((int)args.size() != m_arity)) {
+        return NULL;
+    }
+
+    malEnvPtr frame(new malEnv(lambda->getEnv(), m_scope->size()));
+    for (int i = 0; i < m_arity; i++) {
+        frame->setSlot(i, args[i]->run(env));
+    }
+    return frame;
+}
+
+class malCallNode : public malNode {
+public:
+    malCallNode(malValuePtr form, const malScopePtr& scope,
+                malNodePtr op, const malNodeVec& args)
+    : m_form(form), m_scope(scope), m_op(op), m_args(args)
+    , m_isGlobal(dynamic_cast<const malSymbolNode*>(op.ptr()) != NULL) { }
 
-            if (special == "quasiquoteexpand") {
-                checkArgsIs("quasiquote", 1, argCount);
-                return quasiquote(list->item(1));
+    virtual malValuePtr exec(malEnvRef env, malEnvPtr& nextEnv,
+                             malNodePtr& next) const {
+        if (m_expansion) {
+            next = m_expansion;
+            return NULL;
+        }
+
+        malValuePtr op = m_op->run(env);
+        const malLambda* lambda = DYNAMIC_CAST(malLambda, op);
+        if (lambda && lambda->isMacro()) {
+            // The operator has become a macro since this was analysed. As
+            // with any other macro call, a global is only expanded once,
+            // but a local may hold something else next time.
+            int size = m_scope ? m_scope->size() : 0;
+            next = expandMacro(op, m_form, m_scope);
+            if (m_scope && m_scope->size() > size) {
+                s_lateLocals++;
+            }
+            if (m_isGlobal) {
+                m_expansion = next;
             }
+            return NULL;
+        }
 
-            if (special == "quasiquote") {
-                checkArgsIs("quasiquote", 1, argCount);
-                ast = quasiquote(list->item(1));
-                continue; // TCO
+        const malCode* fnCode = lambda ? lambda->getCode().ptr() : NULL;
+        const malFnCode* code = (fnCode && fnCode->type() == MAL_CODE_NODES)
+            ? static_cast<const malFnCode*>(fnCode) : NULL;
+        if (code) {
+            if (malEnvPtr frame = code->runArgs(lambda, m_args, env)) {
+                next = code->body();
+                nextEnv = std::move(frame);
+                return NULL;
             }
+        }
+
+        std::unique_ptr<malValueVec> args(runNodes(m_args, env));
+        if (code) {
+            next = code->body();
+            nextEnv = code->makeEnv(lambda, args->data(), args->data() + args->size());
+            return NULL;
+        }
+        return APPLY(op, args->data(), args->data() + args->size());
+    }
+
+private:
+    const malValuePtr m_form;
+    const malScopePtr m_scope;
+    const malNodePtr  m_op;
+    const malNodeVec  m_args;
+    const bool        m_isGlobal;
+    mutable malNodePtr m_expansion;
+};
+
+// Defines a global through its cell, or else a local in the current frame.
+class malDefNode : public malNode {
+public:
+    malDefNode(const malCellPtr& cell, int slot, malNodePtr value,
+               bool isMacro)
+    : m_cell(cell), m_slot(slot), m_value(value), m_isMacro(isMacro) { }
+
+    virtual malValuePtr exec(malEnvRef env, malEnvPtr& nextEnv,
+                             malNodePtr& next) const {
+        malValuePtr value = m_value->run(env);
+        if (m_isMacro) {
+            const malLambda* lambda = VALUE_CAST(malLambda, value);
+            value = mal::macro(*lambda);
+        }
+        if (m_cell) {
+            m_cell->set(value);
+        }
+        else {
+            env->setSlot(m_slot, value);
+        }
+        return value;
+    }
+
+private:
+    const malCellPtr m_cell;
+    const int        m_slot;
+    const malNodePtr m_value;
+    const bool       m_isMacro;
+};
+
+class malDoNode : public malNode {
+public:
+    malDoNode(const malNodeVec& forms) : m_forms(forms) { }
+
+    virtual malValuePtr exec(malEnvRef env, malEnvPtr& nextEnv,
+                             malNodePtr& next) const {
+        for (auto it = m_forms.begin(), end = m_forms.end() - 1;
+             it != end; ++it) {
+            (*it)->run(env);
+        }
+        next = m_forms.back();
+        return NULL;
+    }
+
+private:
+    const malNodeVec m_forms;
+};
+
+class malFnNode : public malNode {
+public:
+    malFnNode(const SymbolIdVec& params, malValuePtr body, malCodePtr code)
+    : m_params(params), m_body(body), m_code(code) { }
 
-            if (special == "quote") {
-                checkArgsIs("quote", 1, argCount);
-                return list->item(1);
+    virtual malValuePtr exec(malEnvRef env, malEnvPtr& nextEnv,
+                             malNodePtr& next) const {
+        return mal::lambda(m_params, m_body, env, m_code);
+    }
+
+private:
+    const SymbolIdVec m_params;
+    const malValuePtr m_body;
+    const malCodePtr  m_code;
+};
+
+class malIfNode : public malNode {
+public:
+    malIfNode(malNodePtr test, malNodePtr then, malNodePtr otherwise)
+    : m_test(test), m_then(then), m_else(otherwise) { }
+
+    virtual malValuePtr exec(malEnvRef env, malEnvPtr& nextEnv,
+                             malNodePtr& next) const {
+        if (m_test->run(env).isTrue()) {
+            next = m_then;
+        }
+        else if (m_else) {
+            next = m_else;
+        }
+        else {
+            return mal::nilValue();
+        }
+        return NULL;
+    }
+
+private:
+    const malNodePtr m_test;
+    const malNodePtr m_then;
+    const malNodePtr m_else;
+};
+
+class malLetNode : public malNode {
+public:
+    typedef std::vector<std::pair<int, malNodePtr> > Bindings;
+
+    malLetNode(const malScopePtr& scope, const Bindings& bindings,
+               malNodePtr body)
+    : m_scope(scope), m_bindings(bindings), m_body(body) { }
+
+    virtual malValuePtr exec(malEnvRef env, malEnvPtr& nextEnv,
+                             malNodePtr& next) const {
+        malEnvPtr inner(new malEnv(env, m_scope->size()));
+        for (auto it = m_bindings.begin(), end = m_bindings.end();
+             it != end; ++it) {
+            inner->setSlot(it->first, it->second->run(inner));
+        }
+        next = m_body;
+        nextEnv = std::move(inner);
+        return NULL;
+    }
+
+private:
+    const malScopePtr m_scope;
+    const Bindings    m_bindings;
+    const malNodePtr  m_body;
+};
+
+class malMacroExpandNode : public malNode {
+public:
+    malMacroExpandNode(malValuePtr form) : m_form(form) { }
+
+    virtual malValuePtr exec(malEnvRef env, malEnvPtr& nextEnv,
+                             malNodePtr& next) const {
+        return macroExpand(m_form, env);
+    }
+
+private:
+    const malValuePtr m_form;
+};
+
+class malTryNode : public malNode {
+public:
+    malTryNode(malNodePtr body, const malScopePtr& scope, malNodePtr handler)
+    : m_body(body), m_scope(scope), m_handler(handler) { }
+
+    virtual malValuePtr exec(malEnvRef env, malEnvPtr& nextEnv,
+                             malNodePtr& next) const {
+        malValuePtr excVal;
+
+        try {
+            return m_body->run(env);
+        }
+        catch(String& s) {
+            excVal = mal::string(s);
+        }
+        catch (malEmptyInputException&) {
+            // Not an error, continue as if we got nil
+            return mal::nilValue();
+        }
+        catch(malValuePtr& o) {
+            excVal = o;
+        };
+
+        malEnvPtr inner(new malEnv(env, m_scope->size()));
+        inner->setSlot(0, std::move(excVal));
+        next = m_handler;
+        nextEnv = std::move(inner);
+        return NULL;
+    }
+
+private:
+    const malNodePtr  m_body;
+    const malScopePtr m_scope;
+    const malNodePtr  m_handler;
+};
+
+// Errors found during analysis are only raised if the code is run, which
+// is when an interpreter would have found them.
+class malErrorNode : public malNode {
+public:
+    malErrorNode(const String& message) : m_message(message) { }
+    malErrorNode(malValuePtr value) : m_value(value) { }
+
+    virtual malValuePtr exec(malEnvRef env, malEnvPtr& nextEnv,
+                             malNodePtr& next) const {
+        if (m_value) {
+            throw m_value;
+        }
+        throw m_message;
+    }
+
+private:
+    const String      m_message;
+    const malValuePtr m_value;
+};
+
+static malNodeVec analyzeItems(const malSequence* seq, int first,
+                               const malScopePtr& scope)
+{
+    malNodeVec nodes;
+    nodes.reserve(seq->count() - first);
+    for (int i = first; i < seq->count(); i++) {
+        nodes.push_back(analyze(seq->item(i), scope));
+    }
+    return nodes;
+}
+
+// Returns the macro that a symbol refers to, or NULL if it isn't a macro or
+// is shadowed by a local binding.
+static malValuePtr globalMacro(SymbolId id, const malScopePtr& scope)
+{
+    if (scope && scope->isBound(id)) {
+        return NULL;
+    }
+    const malValuePtr& value = replEnv->cell(id)->value();
+    const malLambda* lambda = DYNAMIC_CAST(malLambda, value);
+    return (lambda && lambda->isMacro()) ? value : malValuePtr();
+}
+
+static malNodePtr expandMacro(malValuePtr macro, malValuePtr ast,
+                              const malScopePtr& scope)
+{
+    const malSequence* seq = STATIC_CAST(malSequence, ast);
+    const malLambda* lambda = STATIC_CAST(malLambda, macro);
+    return analyze(lambda->apply(seq->begin() + 1, seq->end()), scope);
+}
+
+static malNodePtr analyzeList(malValuePtr ast, const malScopePtr& scope)
+{
+    const malList* list = STATIC_CAST(malList, ast);
+    try {
+        if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, list->item(0))) {
+            if (SpecialForm* handler = specialForm(symbol->id())) {
+                return handler(list, scope);
+            }
+            if (malValuePtr macro = globalMacro(symbol->id(), scope)) {
+                return expandMacro(macro, ast, scope);
             }
+        }
+
+        malNodeVec args = analyzeItems(list, 1, scope);
+        return new malCallNode(ast, scope, analyze(list->item(0), scope), args);
+    }
+    catch (String& s) {
+        return new malErrorNode(s);
+    }
+    catch (malValuePtr& o) {
+        return new malErrorNode(o);
+    }
+}
+
+static malNodePtr analyzeLocal(SymbolId id, const malScopePtr& scope,
+                               int depth, int slot)
+{
+    malNodePtr shadowed;
+    int outerDepth = depth, outerSlot = slot;
+    if (scope->resolveNext(id, false, outerDepth, outerSlot)) {
+        shadowed = analyzeLocal(id, scope, outerDepth, outerSlot);
+    }
+    return new malLocalNode(id, scope, depth, slot, shadowed);
+}
+
+static malNodePtr analyzeSymbol(SymbolId id, const malScopePtr& scope)
+{
+    int depth, slot;
+    if (scope && scope->resolve(id, false, depth, slot)) {
+        return analyzeLocal(id, scope, depth, slot);
+    }
+    return new malSymbolNode(replEnv->cell(id), scope);
+}
 
-            if (special == "try*") {
-                malValuePtr tryBody = list->item(1);
-
-                if (argCount == 1) {
-                    ast = EVAL(tryBody, env);
-                    continue; // TCO
-                }
-                checkArgsIs("try*", 2, argCount);
-                const malList* catchBlock = VALUE_CAST(malList, list->item(2));
-
-                checkArgsIs("catch*", 2, catchBlock->count() - 1);
-                MAL_CHECK(VALUE_CAST(malSymbol,
-                    catchBlock->item(0))->value() == "catch*",
-                    "catch block must begin with catch*");
-
-                // We don't need excSym at this scope, but we want to check
-                // that the catch block is valid always, not just in case of
-                // an exception.
-                const malSymbol* excSym =
-                    VALUE_CAST(malSymbol, catchBlock->item(1));
-
-                malValuePtr excVal;
-
-                try {
-                    ast = EVAL(tryBody, env);
-                }
-                catch(String& s) {
-                    excVal = mal::string(s);
-                }
-                catch (malEmptyInputException&) {
-                    // Not an error, continue as if we got nil
-                    ast = mal::nilValue();
-                }
-                catch(malValuePtr& o) {
-                    excVal = o;
-                };
-
-                if (excVal) {
-                    // we got some exception
-                    env = malEnvPtr(new malEnv(env));
-                    env->set(excSym->value(), excVal);
-                    ast = catchBlock->item(2);
-                }
-                continue; // TCO
+static malNodePtr analyze(malValuePtr ast, const malScopePtr& scope)
+{
+    if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, ast)) {
+        return analyzeSymbol(symbol->id(), scope);
+    }
+    if (const malList* list = DYNAMIC_CAST(malList, ast)) {
+        if (!list->isEmpty()) {
+            return analyzeList(ast, scope);
+        }
+    }
+    else if (const malVector* vector = DYNAMIC_CAST(malVector, ast)) {
+        return new malVectorNode(analyzeItems(vector, 0, scope));
+    }
+    else if (const malHash* hash = DYNAMIC_CAST(malHash, ast)) {
+        if (!hash->isEvaluated()) {
+            malNodeVec items;
+            malValuePtr keyList = hash->keys();
+            const malSequence* keys = STATIC_CAST(malSequence, keyList);
+            for (auto it = keys->begin(), end = keys->end(); it != end; ++it) {
+                items.push_back(new malConstantNode(*it));
+                items.push_back(analyze(hash->get(*it), scope));
             }
+            return new malHashNode(items);
         }
+    }
+    return new malConstantNode(ast);
+}
 
-        // Now we're left with the case of a regular list to be evaluated.
-        std::unique_ptr<malValueVec> items(list->evalItems(env));
-        malValuePtr op = items->at(0);
-        if (const malLambda* lambda = DYNAMIC_CAST(malLambda, op)) {
-            ast = lambda->getBody();
-            env = lambda->makeEnv(items->begin()+1, items->end());
-            continue; // TCO
+// Outside of any fn*, let* or catch*, this defines a global. Otherwise it
+// defines (or redefines) a variable in the innermost frame.
+static malNodePtr analyzeDefinition(const malList* list,
+                                    const malScopePtr& scope, bool isMacro)
+{
+    SymbolId id = VALUE_CAST(malSymbol, list->item(1))->id();
+    if (!scope) {
+        return new malDefNode(replEnv->cell(id), -1,
+                              analyze(list->item(2), scope), isMacro);
+    }
+
+    int slot = scope->slotOf(id);
+    if (slot < 0) {
+        slot = scope->declare(id);
+    }
+    malNodePtr value = analyze(list->item(2), scope);
+    scope->define(slot);
+    return new malDefNode(NULL, slot, value, isMacro);
+}
+
+static malNodePtr analyzeDef(const malList* list, const malScopePtr& scope)
+{
+    checkArgsIs("def!", 2, list->count() - 1);
+    return analyzeDefinition(list, scope, false);
+}
+
+static malNodePtr analyzeDefMacro(const malList* list,
+                                  const malScopePtr& scope)
+{
+    checkArgsIs("defmacro!", 2, list->count() - 1);
+    return analyzeDefinition(list, scope, true);
+}
+
+static malNodePtr analyzeDo(const malList* list, const malScopePtr& scope)
+{
+    int argCount = checkArgsAtLeast("do", 1, list->count() - 1);
+    if (argCount == 1) {
+        return analyze(list->item(1), scope);
+    }
+    return new malDoNode(analyzeItems(list, 1, scope));
+}
+
+static malNodePtr analyzeFn(const malList* list, const malScopePtr& scope)
+{
+    checkArgsIs("fn*", 2, list->count() - 1);
+
+    const malSequence* bindings = VALUE_CAST(malSequence, list->item(1));
+    malScopePtr inner(new malScope(scope, true));
+    SymbolIdVec params;
+    int count = bindings->count();
+    bool isVariadic = false;
+    for (int i = 0; i < count; i++) {
+        const malSymbol* sym = VALUE_CAST(malSymbol, bindings->item(i));
+        params.push_back(sym->id());
+        if (sym->id() == s_ampersandId) {
+            MAL_CHECK(i == count - 2, "There must be one parameter after the &");
+            isVariadic = true;
+            continue;
         }
-        else {
-            return APPLY(op, items->begin()+1, items->end());
+        inner->bind(sym->id());
+    }
+
+    malValuePtr body = list->item(2);
+    int arity = isVariadic ? count - 2 : count;
+    malNodePtr node = analyze(body, inner);
+    return new malFnNode(params, body,
+                         new malFnCode(inner, arity, isVariadic, node));
+}
+
+static malNodePtr analyzeIf(const malList* list, const malScopePtr& scope)
+{
+    int argCount = checkArgsBetween("if", 2, 3, list->count() - 1);
+
+    return new malIfNode(analyze(list->item(1), scope),
+                         analyze(list->item(2), scope),
+                         argCount == 3 ? analyze(list->item(3), scope)
+                                       : malNodePtr());
+}
+
+static malNodePtr analyzeLet(const malList* list, const malScopePtr& scope)
+{
+    checkArgsIs("let*", 2, list->count() - 1);
+    const malSequence* bindings = VALUE_CAST(malSequence, list->item(1));
+    int count = checkArgsEven("let*", bindings->count());
+
+    // The bindings share a frame, so a closure in one of them can see the
+    // ones that follow it.
+    malScopePtr inner(new malScope(scope, false));
+    for (int i = 0; i < count; i += 2) {
+        inner->declare(VALUE_CAST(malSymbol, bindings->item(i))->id());
+    }
+    malLetNode::Bindings nodes;
+    for (int i = 0; i < count; i += 2) {
+        int slot = i / 2;
+        nodes.push_back(std::make_pair(slot,
+                                       analyze(bindings->item(i+1), inner)));
+        inner->define(slot);
+    }
+    return new malLetNode(inner, nodes, analyze(list->item(2), inner));
+}
+
+static malNodePtr analyzeMacroExpand(const malList* list,
+                                     const malScopePtr& scope)
+{
+    checkArgsIs("macroexpand", 1, list->count() - 1);
+    return new malMacroExpandNode(list->item(1));
+}
+
+static malNodePtr analyzeQuasiQuoteExpand(const malList* list,
+                                          const malScopePtr& scope)
+{
+    checkArgsIs("quasiquote", 1, list->count() - 1);
+    return new malConstantNode(quasiquote(list->item(1)));
+}
+
+static malNodePtr analyzeQuasiQuote(const malList* list,
+                                    const malScopePtr& scope)
+{
+    checkArgsIs("quasiquote", 1, list->count() - 1);
+    return analyze(quasiquote(list->item(1)), scope);
+}
+
+static malNodePtr analyzeQuote(const malList* list, const malScopePtr& scope)
+{
+    checkArgsIs("quote", 1, list->count() - 1);
+    return new malConstantNode(list->item(1));
+}
+
+static malNodePtr analyzeTry(const malList* list, const malScopePtr& scope)
+{
+    int argCount = list->count() - 1;
+    if (argCount == 1) {
+        return analyze(list->item(1), scope);
+    }
+    checkArgsIs("try*", 2, argCount);
+    const malList* catchBlock = VALUE_CAST(malList, list->item(2));
+
+    checkArgsIs("catch*", 2, catchBlock->count() - 1);
+    MAL_CHECK(VALUE_CAST(malSymbol, catchBlock->item(0))->id() == s_catchId,
+        "catch block must begin with catch*");
+
+    const malSymbol* excSym = VALUE_CAST(malSymbol, catchBlock->item(1));
+    malScopePtr inner(new malScope(scope, false));
+    inner->bind(excSym->id());
+
+    return new malTryNode(analyze(list->item(1), scope), inner,
+                          analyze(catchBlock->item(2), inner));
+}
+
+static struct {
+    const char*  symbol;
+    SpecialForm* handler;
+} specialFormTable[] = {
+    { "def!",               analyzeDef },
+    { "defmacro!",          analyzeDefMacro },
+    { "do",                 analyzeDo },
+    { "fn*",                analyzeFn },
+    { "if",                 analyzeIf },
+    { "let*",               analyzeLet },
+    { "macroexpand",        analyzeMacroExpand },
+    { "quasiquoteexpand",   analyzeQuasiQuoteExpand },
+    { "quasiquote",         analyzeQuasiQuote },
+    { "quote",              analyzeQuote },
+    { "try*",               analyzeTry },
+};
+
+static void installSpecialForms()
+{
+    for (auto &form : specialFormTable) {
+        SymbolId id = internSymbol(form.symbol);
+        if (id >= (int)s_specialForms.size()) {
+            s_specialForms.resize(id + 1);
+        }
+        s_specialForms[id] = form.handler;
+    }
+}
+
+static SpecialForm* specialForm(SymbolId id)
+{
+    return id < (int)s_specialForms.size() ? s_specialForms[id] : NULL;
+}
+
+malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
+{
+    if (!env) {
+        env = replEnv;
+    }
+
+    // The forms in a top-level do are analysed and run one at a time, so
+    // that macros defined by one form (e.g. in a file being loaded) are
+    // expanded in the forms that follow it.
+    while (const malList* list = DYNAMIC_CAST(malList, ast)) {
+        if ((list->count() < 2) || !isSymbol(list->item(0), s_doId)) {
+            break;
         }
+        for (int i = 1; i < list->count() - 1; i++) {
+            EVAL(list->item(i), env);
+        }
+        ast = list->item(list->count() - 1);
+    }
+
+    if (s_useVM) {
+        return vmEval(ast, env);
     }
+    return analyze(ast, NULL)->run(env);
 }
 
 String PRINT(malValuePtr ast)
@@ -254,7 +1054,7 @@ String PRINT(malValuePtr ast)
     return ast->print(true);
 }
 
-malValuePtr APPLY(malValuePtr op, malValueIter argsBegin, malValueIter argsEnd)
+malValuePtr APPLY(const malValuePtr& op, malValueIter argsBegin, malValueIter argsEnd)
 {
     const malApplicable* handler = DYNAMIC_CAST(malApplicable, op);
     MAL_CHECK(handler != NULL,
@@ -263,46 +1063,50 @@ malValuePtr APPLY(malValuePtr op, malValueIter argsBegin, malValueIter argsEnd)
     return handler->apply(argsBegin, argsEnd);
 }
 
-static bool isSymbol(malValuePtr obj, const String& text)
+static bool isSymbol(malValuePtr obj, SymbolId id)
 {
     const malSymbol* sym = DYNAMIC_CAST(malSymbol, obj);
-    return sym && (sym->value() == text);
+    return sym && (sym->id() == id);
 }
 
 //  Return arg when ast matches ('sym, arg), else NULL.
-static malValuePtr starts_with(const malValuePtr ast, const char* sym)
+static malValuePtr starts_with(const malValuePtr ast, SymbolId sym)
 {
     const malList* list = DYNAMIC_CAST(malList, ast);
     if (!list || list->isEmpty() || !isSymbol(list->item(0), sym))
         return NULL;
-    checkArgsIs(sym, 1, list->count() - 1);
+    checkArgsIs(symbolName(sym).c_str(), 1, list->count() - 1);
     return list->item(1);
 }
 
-static malValuePtr quasiquote(malValuePtr obj)
+malValuePtr quasiquote(malValuePtr obj)
 {
     if (DYNAMIC_CAST(malSymbol, obj) || DYNAMIC_CAST(malHash, obj))
-        return mal::list(mal::symbol("quote"), obj);
+        return mal::list(mal::symbol(s_quoteId), obj);
 
     const malSequence* seq = DYNAMIC_CAST(malSequence, obj);
     if (!seq)
         return obj;
 
-    const malValuePtr unquoted = starts_with(obj, "unquote");
+    const malValuePtr unquoted = starts_with(obj, s_unquoteId);
     if (unquoted)
         return unquoted;
 
+    if (malValuePtr cached = seq->quasiquoted())
+        return cached;
+
     malValuePtr res = mal::list(new malValueVec(0));
     for (int i=seq->count()-1; 0<=i; i--) {
         const malValuePtr elt     = seq->item(i);
-        const malValuePtr spl_unq = starts_with(elt, "splice-unquote");
+        const malValuePtr spl_unq = starts_with(elt, s_spliceUnquoteId);
         if (spl_unq)
-            res = mal::list(mal::symbol("concat"), spl_unq, res);
+            res = mal::list(mal::symbol(s_concatId), spl_unq, res);
          else
-            res = mal::list(mal::symbol("cons"), quasiquote(elt), res);
+            res = mal::list(mal::symbol(s_consId), quasiquote(elt), res);
     }
     if (DYNAMIC_CAST(malVector, obj))
-        res = mal::list(mal::symbol("vec"), res);
+        res = mal::list(mal::symbol(s_vecId), res);
+    seq->setQuasiquoted(res);
     return res;
 }
 
@@ -311,18 +1115,16 @@ static const malLambda* isMacroApplication(malValuePtr obj, malEnvPtr env)
     const malList* seq = DYNAMIC_CAST(malList, obj);
     if (seq && !seq->isEmpty()) {
         if (malSymbol* sym = DYNAMIC_CAST(malSymbol, seq->item(0))) {
-            if (malEnvPtr symEnv = env->find(sym->value())) {
-                malValuePtr value = sym->eval(symEnv);
-                if (malLambda* lambda = DYNAMIC_CAST(malLambda, value)) {
-                    return lambda->isMacro() ? lambda : NULL;
-                }
+            malCellPtr cell = env->getRoot()->cell(sym->id());
+            if (malLambda* lambda = DYNAMIC_CAST(malLambda, cell->value())) {
+                return lambda->isMacro() ? lambda : NULL;
             }
         }
     }
     return NULL;
 }
 
-static malValuePtr macroExpand(malValuePtr obj, malEnvPtr env)
+malValuePtr macroExpand(malValuePtr obj, malEnvPtr env)
 {
     while (const malLambda* macro = isMacroApplication(obj, env)) {
         const malSequence* seq = STATIC_CAST(malSequence, obj);